@@ -0,0 +1,120 @@
+//
+//  mkbuiltins.c
+//  myLISP
+//
+//  Reads builtins.def on stdin and writes builtins.h on stdout: the
+//  builtin function values plus a perfect hash from name to value.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BUILTINS 256
+
+static char names[MAX_BUILTINS][64];
+static char funcs[MAX_BUILTINS][64];
+static int count;
+
+/* must match lsym_hash in parsing.c */
+static unsigned long fnv1a(const char* s){
+    unsigned long h = 2166136261UL;
+    while (*s) { h = (h ^ (unsigned char)*s++) * 16777619UL; }
+    return h;
+}
+
+/* must match lbuiltin_lookup in the generated header */
+static unsigned long slot_of(unsigned long h, unsigned long seed, int size){
+    return ((h ^ seed) * 2654435761UL) % size;
+}
+
+/* 1 if every name lands in its own slot */
+static int try_seed(unsigned long seed, int size, int* slots){
+    for (int i = 0; i < size; i++) { slots[i] = -1; }
+    for (int i = 0; i < count; i++){
+        unsigned long s = slot_of(fnv1a(names[i]), seed, size);
+        if (slots[s] >= 0) { return 0; }
+        slots[s] = i;
+    }
+    return 1;
+}
+
+int main(void){
+    char line[256];
+    while (fgets(line, sizeof(line), stdin)){
+        char name[64], func[64];
+        if (line[0] == '#') { continue; }
+        if (sscanf(line, "%63s %63s", name, func) != 2) { continue; }
+        if (count == MAX_BUILTINS){
+            fprintf(stderr, "mkbuiltins: too many builtins\n");
+            return 1;
+        }
+        strcpy(names[count], name);
+        strcpy(funcs[count], func);
+        count++;
+    }
+
+    /* smallest table, then lowest seed, with no collisions */
+    static int slots[MAX_BUILTINS * 4];
+    int size = count ? count : 1;
+    unsigned long seed = 0;
+    for (;; size++){
+        if (size > MAX_BUILTINS * 4){
+            fprintf(stderr, "mkbuiltins: no perfect hash found\n");
+            return 1;
+        }
+        for (seed = 0; seed < 100000; seed++){
+            if (try_seed(seed, size, slots)) { break; }
+        }
+        if (seed < 100000) { break; }
+    }
+
+    puts("/* Generated by mkbuiltins from builtins.def; do not edit */\n");
+
+    for (int i = 0; i < count; i++){
+        printf("lval* %s(lenv* e, lval* a);\n", funcs[i]);
+    }
+
+    printf("\n#define LBUILTIN_COUNT %d\n", count);
+    printf("#define LBUILTIN_SIZE %d\n", size);
+    printf("#define LBUILTIN_SEED %luUL\n\n", seed);
+
+    puts("/* statically allocated, so startup allocates nothing per builtin */");
+    puts("static lval lbuiltin_vals[LBUILTIN_COUNT] = {");
+    for (int i = 0; i < count; i++){
+        printf("    { .type = LVAL_FUN, .refs = LVAL_STATIC_REFS, "
+               ".flags = LVAL_F_STATIC, .fun = %s },\n", funcs[i]);
+    }
+    puts("};\n");
+
+    puts("static const char* const lbuiltin_names[LBUILTIN_SIZE] = {");
+    for (int i = 0; i < size; i++){
+        if (slots[i] < 0) { puts("    NULL,"); continue; }
+        /* '\\' is a symbol character, and the only one to escape */
+        fputs("    \"", stdout);
+        for (const char* c = names[slots[i]]; *c; c++){
+            if (*c == '\\') { putchar('\\'); }
+            putchar(*c);
+        }
+        puts("\",");
+    }
+    puts("};\n");
+
+    puts("static lval* const lbuiltin_slots[LBUILTIN_SIZE] = {");
+    for (int i = 0; i < size; i++){
+        if (slots[i] < 0) { puts("    NULL,"); continue; }
+        printf("    &lbuiltin_vals[%d],\n", slots[i]);
+    }
+    puts("};\n");
+
+    puts("/* builtin named name, whose lsym_hash is hash, or NULL */");
+    puts("static lval* lbuiltin_lookup(const char* name, unsigned long hash){");
+    puts("    unsigned long i = ((hash ^ LBUILTIN_SEED) * 2654435761UL) % LBUILTIN_SIZE;");
+    puts("    if (lbuiltin_names[i] && strcmp(lbuiltin_names[i], name) == 0){");
+    puts("        return lbuiltin_slots[i];");
+    puts("    }");
+    puts("    return NULL;");
+    puts("}");
+
+    return 0;
+}
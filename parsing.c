@@ -8,6 +8,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+/* vector kernels for bulk arithmetic, picked at run time */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LSIMD_X86
+#include <immintrin.h>
+#endif
 
 #include <editline/readline.h>
 
@@ -19,37 +27,387 @@
 /* Forward Declarations */
 struct lval;
 struct lenv;
+struct lsym;
+struct lbuf;
+struct lcode;
 
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lsym lsym;
+typedef struct lbuf lbuf;
+typedef struct lcode lcode;
 
 /* create enumeration of possible lval types*/
-enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPRE, LVAL_QEXPRE, LVAL_FUN};
+enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPRE, LVAL_QEXPRE, LVAL_FUN,
+      LVAL_PAIR, LVAL_CODE, LVAL_THUNK, LVAL_FREE};
+
+/* header flag bits */
+#define LVAL_F_MARK  1
+#define LVAL_F_ARENA 2      /* lives in the per-input arena */
+#define LVAL_F_STATIC 4     /* statically allocated, never freed */
+#define LVAL_F_FORCING 8    /* thunk whose value is being computed */
+#define LVAL_F_PRINTING 16  /* forced thunk whose value is being printed */
+
+/* static values start with enough owners that they never run out */
+#define LVAL_STATIC_REFS (INT_MAX / 2)
 
 /* declare lval(LISP value) struct */
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* lists this short keep their cells inside the header itself */
+#define LVAL_INLINE 4
+
+/* only one payload is live at a time, selected by type */
 struct lval {
     int type;
-    long num;
-    /* Char for Error and Symbol Types */
-    char* err;
-    char* sym;
-
-    lbuiltin fun;
-
-    /* Pointer to list of "lval*" */
+    /* number of owners; shared values are copied before mutation */
+    int refs;
+    int flags;
     int count;
-    struct lval** cell;    
+
+    union {
+        /* boxed numbers that do not fit in a fixnum */
+        long num;
+        /* Char for Error */
+        char* err;
+        /* interned atom for Symbol, plus the local slot it was resolved
+           to: depth frames up from the frame numbered frame, or depth -1,
+           and an inline cache of the global slot it was last found in
+           when looked up from cenv */
+        struct {
+            lsym* sym;
+            int depth;
+            int slot;
+            unsigned frame;
+            struct lenv* cenv;
+            struct lenv* cfound;
+            unsigned cepoch;
+            int cslot;
+        };
+        /* builtin, or NULL for a lambda: its parameter list and its body,
+           kept as an S-expression resolved against the parameters */
+        struct {
+            lbuiltin fun;
+            struct lval* formals;
+            struct lval* body;
+        };
+        /* Pointer to list of "lval*": count cells starting at cell,
+           which points into inl until the list outgrows it and then into
+           a buffer that several lists may share */
+        struct {
+            struct lval** cell;
+            lbuf* buf;
+            struct lval* inl[LVAL_INLINE];
+        };
+        /* cons pair: a value and the rest of the list, shared not copied */
+        struct {
+            struct lval* car;
+            struct lval* cdr;
+        };
+        /* compiled bytecode, see lval_compile */
+        lcode* code;
+        /* delayed value: an S-expression to evaluate, or a native step
+           tfun to call with a shared reference to targs, which it only
+           reads; tval once it has been forced. tfork numbers the sandbox
+           it was made in, 0 outside any */
+        struct {
+            lbuiltin tfun;
+            struct lval* targs;
+            struct lval* tval;
+            unsigned tfork;
+        };
+        /* free list link while the header sits in the pool */
+        struct lval* next;
+    };
 };
 
+/* Small integers live in the pointer itself: low bit set, value in the rest */
+#define LVAL_FIXNUM_MIN (INTPTR_MIN >> 1)
+#define LVAL_FIXNUM_MAX (INTPTR_MAX >> 1)
+
+static inline int lval_is_fixnum(const lval* v){
+    return ((uintptr_t)v & 1) != 0;
+}
+
+static inline int lval_type(const lval* v){
+    return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_to_num(const lval* v){
+    return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+/* Slab allocator: headers and cell arrays are carved out of large chunks
+   and recycled through per-size free lists instead of going to malloc */
+#define LPOOL_CHUNK   (64 * 1024)
+#define LPOOL_CLASSES 8     /* cell arrays of 1, 2, 4 ... 128 slots */
+
+typedef struct {
+    long live;
+    long peak;
+    long recycled;
+} lpool_stats;
+
+static struct {
+    char* bump;
+    char* end;
+    /* headers get their own chunks so the collector can walk them */
+    lval* hbump;
+    lval* hend;
+    lval** hchunks;
+    int nhchunks;
+    lval* free_hdr;
+    lval** free_cells[LPOOL_CLASSES];
+    lpool_stats hdr;
+    lpool_stats cells;
+} lpool;
+
+static void* lpool_carve(size_t size){
+    if (lpool.bump == NULL || lpool.bump + size > lpool.end){
+        lpool.bump = malloc(LPOOL_CHUNK);
+        lpool.end = lpool.bump + LPOOL_CHUNK;
+    }
+    void* p = lpool.bump;
+    lpool.bump += size;
+    return p;
+}
+
+static void lpool_count_alloc(lpool_stats* st, int recycled){
+    st->live++;
+    if (st->live > st->peak) { st->peak = st->live; }
+    if (recycled) { st->recycled++; }
+}
+
+/* Per-input arena: while active, every new value is bump-allocated and
+   the whole arena is released at once when the input is done. Values
+   that must outlive it are promoted to the pool, see lval_promote */
+typedef struct larena_chunk {
+    struct larena_chunk* next;
+    size_t size;
+    char data[];
+} larena_chunk;
+
+static struct {
+    int active;
+    char* bump;
+    char* end;
+    larena_chunk* used;
+    larena_chunk* spare;
+} larena;
+
+void* larena_alloc(size_t size){
+    size = (size + 7) & ~(size_t)7;
+    if (larena.bump == NULL || larena.bump + size > larena.end){
+        larena_chunk* c = larena.spare;
+        if (c && size <= c->size){
+            larena.spare = c->next;
+        } else {
+            size_t n = size > LPOOL_CHUNK ? size : LPOOL_CHUNK;
+            c = malloc(sizeof(larena_chunk) + n);
+            c->size = n;
+        }
+        c->next = larena.used;
+        larena.used = c;
+        larena.bump = c->data;
+        larena.end = c->data + c->size;
+    }
+    void* p = larena.bump;
+    larena.bump += size;
+    return p;
+}
+
+void larena_begin(void){
+    larena.active = 1;
+}
+
+/* drop everything allocated since larena_begin in one go */
+void larena_end(void){
+    larena.active = 0;
+    while (larena.used){
+        larena_chunk* c = larena.used;
+        larena.used = c->next;
+        if (c->size == LPOOL_CHUNK){
+            c->next = larena.spare;
+            larena.spare = c;
+        } else {
+            free(c);
+        }
+    }
+    larena.bump = larena.end = NULL;
+}
+
+lval* lval_alloc(void){
+    if (larena.active){
+        lval* a = larena_alloc(sizeof(lval));
+        a->refs = 1;
+        a->flags = LVAL_F_ARENA;
+        return a;
+    }
+
+    lval* v = lpool.free_hdr;
+    lpool_count_alloc(&lpool.hdr, v != NULL);
+    if (v){
+        lpool.free_hdr = v->next;
+    } else {
+        if (lpool.hbump == lpool.hend){
+            lpool.hbump = malloc(LPOOL_CHUNK);
+            lpool.hend = lpool.hbump + LPOOL_CHUNK / sizeof(lval);
+            lpool.hchunks = realloc(lpool.hchunks,
+                sizeof(lval*) * (lpool.nhchunks + 1));
+            lpool.hchunks[lpool.nhchunks++] = lpool.hbump;
+        }
+        v = lpool.hbump++;
+    }
+    v->refs = 1;
+    v->flags = 0;
+    return v;
+}
+
+void lval_free(lval* v){
+    /* arena headers go away with the arena */
+    if (v->flags & LVAL_F_ARENA) { return; }
+
+    v->type = LVAL_FREE;
+    v->next = lpool.free_hdr;
+    lpool.free_hdr = v;
+    lpool.hdr.live--;
+}
+
+/* size class holding n cells, or -1 if it is too big for the pool */
+static int lcells_class(int n){
+    int c = 0;
+    while ((1 << c) < n) { c++; }
+    return c < LPOOL_CLASSES ? c : -1;
+}
+
+lval** lcells_alloc(int n){
+    if (n == 0) { return NULL; }
+    int c = lcells_class(n);
+    if (c < 0) { return malloc(sizeof(lval*) * n); }
+
+    lval** cells = lpool.free_cells[c];
+    lpool_count_alloc(&lpool.cells, cells != NULL);
+    if (cells){
+        lpool.free_cells[c] = (lval**)cells[0];
+    } else {
+        cells = lpool_carve(sizeof(lval*) << c);
+    }
+    return cells;
+}
+
+void lcells_free(lval** cells, int n){
+    if (cells == NULL) { return; }
+    int c = lcells_class(n);
+    if (c < 0) { free(cells); return; }
+
+    cells[0] = (lval*)lpool.free_cells[c];
+    lpool.free_cells[c] = cells;
+    lpool.cells.live--;
+}
+
+/* slots actually available in an array allocated for n cells */
+int lcells_capacity(int n){
+    int c = lcells_class(n);
+    return c < 0 ? n : (n ? 1 << c : 0);
+}
+
 void lval_print(lval* v);
+void lval_del(lval* v);
+lval* lval_copy(lval* v);
+lval* lval_own(lval* v);
+lval* lval_promote(lval* v);
 lval* lval_eval(lenv* e, lval* v);
-lval* builtin(lval* l, char* fun);
+lval* lvm_run(lenv* e, lval* code);
+lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_eval_request(void);
+lval* lval_force(lenv* e, lval* v);
+unsigned lenv_fork_serial(lenv* e);
+static void lcode_drop(lcode* c);
+lcode* lcode_promote(lcode* c);
+
+/* Shared cell buffers. A list that outgrows its inline cells views a
+   window of an lbuf; lists made by sharing (lval_own, tails via lval_pop)
+   view the same buffer. The buffer owns one reference to every value in
+   items[0, fill), so views never change it except to append past fill,
+   which no other view can see */
+#define LBUF_ARENA 1        /* allocated from the per-input arena */
+#define LBUF_LIVE  2        /* reached during a collection */
+#define LBUF_DEAD  4        /* queued for freeing by the collector */
+
+struct lbuf {
+    int refs;
+    int fill;
+    int cap;
+    int flags;
+    lval* items[];
+};
+
+/* header size in cell slots, so buffers fit the pool size classes */
+#define LBUF_HDR ((int)(sizeof(lbuf) / sizeof(lval*)))
+
+lbuf* lbuf_new(int n){
+    int slots = lcells_capacity(n + LBUF_HDR);
+    lbuf* b;
+    if (larena.active){
+        b = larena_alloc(sizeof(lval*) * slots);
+        b->flags = LBUF_ARENA;
+    } else {
+        b = (lbuf*)lcells_alloc(slots);
+        b->flags = 0;
+    }
+    b->refs = 1;
+    b->fill = 0;
+    b->cap = slots - LBUF_HDR;
+    return b;
+}
+
+static void lbuf_free(lbuf* b){
+    if (b->flags & LBUF_ARENA) { return; }
+    lcells_free((lval**)b, b->cap + LBUF_HDR);
+}
+
+/* Values whose last owner has let go, waiting for their own children
+   to be released. An explicit stack like the collector's, so freeing a
+   deeply nested value cannot overflow the C stack */
+static struct {
+    lval** stack;
+    int sp;
+    int cap;
+} ldel;
+
+static void ldel_push(lval* v){
+    if (lval_is_fixnum(v)) { return; }
+    if (ldel.sp == ldel.cap){
+        ldel.cap = ldel.cap ? ldel.cap * 2 : 256;
+        ldel.stack = realloc(ldel.stack, sizeof(lval*) * ldel.cap);
+    }
+    ldel.stack[ldel.sp++] = v;
+}
+
+static void ldel_drain(int base);
+
+/* queue the items of a buffer that has lost its last view */
+static void lbuf_drop(lbuf* b){
+    if (--b->refs > 0) { return; }
+    for (int i = 0; i < b->fill; i++){
+        /* slots popped off the front have been handed out already */
+        if (b->items[i]) { ldel_push(b->items[i]); }
+    }
+    lbuf_free(b);
+}
+
+void lbuf_release(lbuf* b){
+    int base = ldel.sp;
+    lbuf_drop(b);
+    ldel_drain(base);
+}
 
 /* Contstruct pointer to Number lval */
 lval* lval_num(long x){
-    lval* v = malloc(sizeof(lval));
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX){
+        return (lval*)(((uintptr_t)(intptr_t)x << 1) | 1);
+    }
+    lval* v = lval_alloc();
     v->type = LVAL_NUM;
     v->num = x;
     return v;
@@ -57,107 +415,452 @@ lval* lval_num(long x){
 
 /* Contstruct pointer to Error lval */
 lval* lval_err(char* y){
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_ERR;
     v->err = malloc(strlen(y) + 1);
     strcpy(v->err, y);
     return v;
 } 
 
+/* Symbols are interned: each name has exactly one lsym, so two symbols
+   are equal iff their lsym pointers are */
+struct lsym {
+    char* name;
+    unsigned long hash;
+    /* builtin of this name, and whether a global def has hidden it */
+    lval* builtin;
+    int shadowed;
+    /* ever named by a parameter, let binding or def in code read so far */
+    int rebound;
+};
+
+/* builtin table generated from builtins.def */
+#include "builtins.h"
+
+static struct {
+    int count;
+    int cap;
+    lsym** slots;
+} lsym_table;
+
+unsigned long lsym_hash(const char* s){
+    /* FNV-1a */
+    unsigned long h = 2166136261UL;
+    while (*s) { h = (h ^ (unsigned char)*s++) * 16777619UL; }
+    return h;
+}
+
+static void lsym_grow(void){
+    int cap = lsym_table.cap ? lsym_table.cap * 2 : 256;
+    lsym** slots = calloc(cap, sizeof(lsym*));
+
+    for (int i = 0; i < lsym_table.cap; i++){
+        lsym* s = lsym_table.slots[i];
+        if (s == NULL) { continue; }
+        int j = s->hash & (cap - 1);
+        while (slots[j]) { j = (j + 1) & (cap - 1); }
+        slots[j] = s;
+    }
+    free(lsym_table.slots);
+    lsym_table.slots = slots;
+    lsym_table.cap = cap;
+}
+
+lsym* lsym_intern(const char* name){
+    if ((lsym_table.count + 1) * 4 > lsym_table.cap * 3) { lsym_grow(); }
+
+    unsigned long h = lsym_hash(name);
+    int i = h & (lsym_table.cap - 1);
+    while (lsym_table.slots[i]){
+        lsym* s = lsym_table.slots[i];
+        if (s->hash == h && strcmp(s->name, name) == 0) { return s; }
+        i = (i + 1) & (lsym_table.cap - 1);
+    }
+
+    /* first sighting: the atom lives for the rest of the run */
+    lsym* s = malloc(sizeof(lsym));
+    s->name = malloc(strlen(name) + 1);
+    strcpy(s->name, name);
+    s->hash = h;
+    s->builtin = lbuiltin_lookup(name, h);
+    s->shadowed = 0;
+    s->rebound = 0;
+    lsym_table.slots[i] = s;
+    lsym_table.count++;
+    return s;
+}
+
 /* Contstruct pointer to Symbol; lval */
 lval* lval_sym(char* z){
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(z) + 1);
-    strcpy(v->sym, z);
+    v->sym = lsym_intern(z);
+    v->depth = -1;
+    v->cenv = NULL;
+    return v;
+}
+
+/* Construct a Symbol already resolved to a local slot */
+lval* lval_sym_at(lsym* s, int depth, int slot, unsigned frame){
+    lval* v = lval_alloc();
+    v->type = LVAL_SYM;
+    v->sym = s;
+    v->depth = depth;
+    v->slot = slot;
+    v->frame = frame;
+    v->cenv = NULL;
     return v;
 }
 
 /* Contstruct pointer to SExpression lval */
 lval* lval_sexpre(void){
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SEXPRE;
     v->count = 0;
-    v->cell = NULL;
+    v->cell = v->inl;
+    v->buf = NULL;
     return v;
 }
 
 /* Contstruct pointer to QExpression lval */
 lval* lval_qexpre(void){
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_QEXPRE;
     v->count = 0;
-    v->cell = NULL;
+    v->cell = v->inl;
+    v->buf = NULL;
     return v;
 }
 
-/* Construct pointer for lbuiltin */
-lval* lval_fun(lbuiltin func){
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->fun = func;
+/* Construct pointer to a cons pair, taking ownership of both halves */
+lval* lval_pair(lval* car, lval* cdr){
+    lval* v = lval_alloc();
+    v->type = LVAL_PAIR;
+    v->car = car;
+    v->cdr = cdr;
+    return v;
+}
+
+/* Construct a thunk, taking ownership of args: with f NULL, args is an
+   S-expression evaluated when the thunk is forced, otherwise the already
+   evaluated args f is called with */
+lval* lval_thunk(lenv* e, lbuiltin f, lval* args){
+    lval* v = lval_alloc();
+    v->type = LVAL_THUNK;
+    v->tfun = f;
+    v->targs = args;
+    v->tval = NULL;
+    v->tfork = lenv_fork_serial(e);
     return v;
 }
 
+/* Q-expressions and cons pairs are both lists; pairs are never empty */
+static int lval_is_list(lval* v){
+    int t = lval_type(v);
+    return t == LVAL_QEXPRE || t == LVAL_PAIR;
+}
+
+static int lval_is_empty(lval* v){
+    return lval_type(v) == LVAL_QEXPRE && v->count == 0;
+}
+
+/* Bindings live in dense parallel arrays, in definition order, so a
+   symbol's slot never moves. An open-addressing index keyed on the
+   symbol's cached hash maps symbols to slots; index entries are slot + 1,
+   with 0 marking an empty entry.
+   Environments chain through par: the root holds the globals and is the
+   only one indexed, the frames above it hold a few locals each and are
+   searched by pointer comparison. A global environment made by lenv_fork
+   is an overlay: lookups it misses fall through to its base */
 struct lenv {
+    lenv* par;
+    lenv* base;
     int count;
-    char** syms;
+    int cap;
+    lsym** syms;
     lval** vals;
+    int icap;
+    int* index;
+    /* frames and forks are numbered as they are made, never reusing a
+       number; the real globals are 0 */
+    unsigned serial;
+    /* code resolved against this frame reads frames below it by depth */
+    int outer;
 };
 
 lenv* lenv_new(void){
     lenv* e = malloc(sizeof(lenv));
+    e->par = NULL;
+    e->base = NULL;
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->icap = 0;
+    e->index = NULL;
+    e->serial = 0;
+    e->outer = 0;
+    return e;
+}
+
+/* Evaluator stack: local frames and their bindings are bump-allocated
+   here and popped in LIFO order, so entering a call costs a few pointer
+   bumps rather than a round of mallocs. Chunks above the top are kept
+   for the next deep call */
+#define LSTACK_CHUNK (64 * 1024)
+
+typedef struct lstack_chunk {
+    struct lstack_chunk* prev;
+    struct lstack_chunk* next;
+    char* end;
+    char data[];
+} lstack_chunk;
+
+static struct {
+    lstack_chunk* chunk;
+    char* top;
+} lstack;
+
+static void* lstack_push(size_t size){
+    size = (size + 7) & ~(size_t)7;
+    lstack_chunk* c = lstack.chunk;
+    if (c == NULL || lstack.top + size > c->end){
+        lstack_chunk* n = c ? c->next : NULL;
+        if (n && n->data + size > n->end){
+            /* too small for this frame; nothing above the top is in use */
+            if (c) { c->next = NULL; }
+            while (n) { lstack_chunk* x = n->next; free(n); n = x; }
+        }
+        if (n == NULL){
+            size_t sz = size > LSTACK_CHUNK ? size : LSTACK_CHUNK;
+            n = malloc(sizeof(lstack_chunk) + sz);
+            n->end = n->data + sz;
+            n->prev = c;
+            n->next = NULL;
+            if (c) { c->next = n; }
+        }
+        lstack.chunk = n;
+        lstack.top = n->data;
+    }
+    void* p = lstack.top;
+    lstack.top += size;
+    return p;
+}
+
+/* pop p and everything pushed after it */
+static void lstack_pop(void* p){
+    while ((char*)p < lstack.chunk->data || (char*)p >= lstack.chunk->end){
+        lstack.chunk = lstack.chunk->prev;
+    }
+    lstack.top = p;
+}
+
+static unsigned lenv_serial;
+
+/* local frame for n bindings on top of par, on the evaluator stack */
+lenv* lenv_push_frame(lenv* par, int n){
+    lenv* e = lstack_push(sizeof(lenv) + (sizeof(lsym*) + sizeof(lval*)) * n);
+    e->par = par;
+    e->base = NULL;
+    e->count = 0;
+    e->cap = n;
+    e->syms = (lsym**)(e + 1);
+    e->vals = (lval**)(e->syms + n);
+    e->icap = 0;
+    e->index = NULL;
+    e->serial = ++lenv_serial;
+    e->outer = 0;
     return e;
 }
 
+/* release a frame's bindings and pop it, with any frame above it */
+void lenv_pop_frame(lenv* e){
+    for (int i = 0; i < e->count; i++){
+        lval_del(e->vals[i]);
+    }
+    lstack_pop(e);
+}
+
+/* O(1) sandbox of the global environment e: reads fall through to e,
+   definitions stay in the fork. The fork sees later changes to e, and
+   must be discarded before e is deleted. Forks are numbered like frames */
+lenv* lenv_fork(lenv* e){
+    lenv* f = lenv_new();
+    f->base = e;
+    f->serial = ++lenv_serial;
+    return f;
+}
+
+/* number of the fork whose globals e sees, or 0 for the real globals */
+unsigned lenv_fork_serial(lenv* e){
+    while (e->par) { e = e->par; }
+    return e->serial;
+}
+
 void lenv_del(lenv* e){
     for (int i = 0; i < e->count; i++){
-        free(e->syms[i]);
         lval_del(e->vals[i]);
     }
     free(e->syms);
     free(e->vals);
+    free(e->index);
     free(e);
 }
 
-lval* lenv_get(lenv* e, lval* k){
-    /* Loop over environment to look for symbol */
-    for (int i = 0; i < e->count; i++){
-        if(strcmp(e->syms[i], k->sym) == 0){
-            /* return copy of value if match found */
-            return lval_copy(e->vals[i]);
+static void lenv_index_insert(lenv* e, int slot){
+    int mask = e->icap - 1;
+    int i = e->syms[slot]->hash & mask;
+    while (e->index[i]) { i = (i + 1) & mask; }
+    e->index[i] = slot + 1;
+}
+
+/* make room for n bindings in total without further reallocation */
+void lenv_reserve(lenv* e, int n){
+    if (n > e->cap){
+        e->cap = n;
+        e->syms = realloc(e->syms, sizeof(lsym*) * e->cap);
+        e->vals = realloc(e->vals, sizeof(lval*) * e->cap);
+    }
+
+    /* keep the index at most three quarters full */
+    int icap = e->icap ? e->icap : 16;
+    while (n * 4 > icap * 3) { icap *= 2; }
+    if (icap == e->icap) { return; }
+
+    free(e->index);
+    e->icap = icap;
+    e->index = calloc(icap, sizeof(int));
+    for (int i = 0; i < e->count; i++) { lenv_index_insert(e, i); }
+}
+
+/* slot bound to k in e, or -1 */
+int lenv_find(lenv* e, lsym* k){
+    if (e->index == NULL){
+        for (int i = 0; i < e->count; i++){
+            if (e->syms[i] == k) { return i; }
         }
+        return -1;
+    }
+    int mask = e->icap - 1;
+    for (int i = k->hash & mask; e->index[i]; i = (i + 1) & mask){
+        int slot = e->index[i] - 1;
+        if (e->syms[slot] == k) { return slot; }
     }
-    return lval_err("unbound symbol");
+    return -1;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v){
+/* f was pushed in tail position of the frame p below it. If f binds
+   every name p does, p can no longer be seen by anything, so f's
+   bindings move into p's place and f is popped: a chain of such tail
+   calls runs in one frame. 0 if f has to stay where it is, which
+   includes when f's code reads frames below it by depth: those depths
+   would be one too many once f is gone */
+int lenv_reuse_frame(lenv* p, lenv* f){
+    if (f->par != p || f->outer || f->count > p->cap) { return 0; }
+    for (int i = 0; i < p->count; i++){
+        if (lenv_find(f, p->syms[i]) < 0) { return 0; }
+    }
 
-    for (int i = 0; i < e->count; i++){
-        if(strcmp(e->syms[i], k->sym) == 0){
-            /* if var found, delete and replace */
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+    for (int i = 0; i < p->count; i++){
+        lval_del(p->vals[i]);
+    }
+    memcpy(p->syms, f->syms, sizeof(lsym*) * f->count);
+    memcpy(p->vals, f->vals, sizeof(lval*) * f->count);
+    p->count = f->count;
+    lstack_pop(f);
+    return 1;
+}
+
+/* bumped by every global definition; inline caches from an older epoch
+   are stale */
+unsigned lenv_epoch = 1;
+
+lval* lenv_get(lenv* e, lval* k){
+    /* a resolved symbol names its slot directly. The innermost frame is
+       always searched first, so a slot there holding the symbol is the
+       binding; deeper slots are only trusted from the frame the symbol
+       was resolved in, since code can be evaluated elsewhere */
+    if (k->depth >= 0 && e->par && (k->depth == 0 || k->frame == e->serial)){
+        lenv* f = e;
+        for (int d = k->depth; d > 0 && f; d--) { f = f->par; }
+        if (f && f->par && k->slot < f->count && f->syms[k->slot] == k->sym){
+            return lval_copy(f->vals[k->slot]);
         }
     }
 
-    /* allocate space for new entry */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    for (; e->par; e = e->par){
+        int slot = lenv_find(e, k->sym);
+        /* return shared reference if match found */
+        if (slot >= 0) { return lval_copy(e->vals[slot]); }
+    }
 
-    /* */
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-    strcpy(e->syms[e->count-1], k->sym);
+    /* builtins come before user definitions unless a def hid them */
+    lsym* s = k->sym;
+    if (s->builtin && !s->shadowed) { return lval_copy(s->builtin); }
+
+    /* globals: the symbol node remembers where it was found last time */
+    if (k->cenv == e && k->cepoch == lenv_epoch){
+        return lval_copy(k->cfound->vals[k->cslot]);
+    }
+    for (lenv* g = e; g; g = g->base){
+        int slot = lenv_find(g, s);
+        if (slot < 0) { continue; }
+        k->cenv = e;
+        k->cfound = g;
+        k->cepoch = lenv_epoch;
+        k->cslot = slot;
+        return lval_copy(g->vals[slot]);
+    }
+    return s->builtin ? lval_copy(s->builtin) : lval_err("unbound symbol");
+}
 
+/* a fork's own definitions go with it, and so do caches that point at it */
+void lenv_discard(lenv* f){
+    lenv_epoch++;
+    lenv_del(f);
 }
 
+void lenv_put(lenv* e, lval* k, lval* v){
+    int slot = lenv_find(e, k->sym);
+    /* only globals outlive the current input */
+    lval* x = e->par ? lval_copy(v) : lval_promote(v);
+    if (slot >= 0){
+        if (e->par == NULL) { lenv_epoch++; }
+        /* if var found, replace and release the old value */
+        lval* old = e->vals[slot];
+        e->vals[slot] = x;
+        lval_del(old);
+        return;
+    }
+
+    /* frames are sized up front and never indexed */
+    if (e->par){
+        k->sym->rebound = 1;
+        e->syms[e->count] = k->sym;
+        e->vals[e->count] = x;
+        e->count++;
+        return;
+    }
+
+    lenv_epoch++;
+    k->sym->shadowed = 1;
+
+    /* grow geometrically so definitions are amortized O(1) */
+    if (e->count == e->cap || (e->count + 1) * 4 > e->icap * 3){
+        lenv_reserve(e, e->count ? e->count * 2 : 16);
+    }
+
+    e->syms[e->count] = k->sym;
+    e->vals[e->count] = x;
+    lenv_index_insert(e, e->count);
+    e->count++;
+}
 
+/* define in the global environment, wherever e is in the chain */
+void lenv_def(lenv* e, lval* k, lval* v){
+    while (e->par) { e = e->par; }
+    lenv_put(e, k, v);
+}
 
 lval* lval_read_num(mpc_ast_t* t){
     errno = 0;
@@ -165,13 +868,163 @@ lval* lval_read_num(mpc_ast_t* t){
     return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
 }
 
+/* drop v's cells and go back to the empty inline buffer */
+static void lval_reset_cells(lval* v){
+    if (v->buf) { lbuf_release(v->buf); }
+    v->count = 0;
+    v->cell = v->inl;
+    v->buf = NULL;
+}
+
+/* v's window ends where its buffer's values do, and nobody else sees it */
+static int lval_cells_exclusive(lval* v){
+    lbuf* b = v->buf;
+    return b->refs == 1 && v->cell + v->count == b->items + b->fill;
+}
+
+/* move v's cells into a fresh buffer with room for n */
+static void lval_rebuf(lval* v, int n){
+    lbuf* b = lbuf_new(n);
+
+    /* cells are moved when v holds the only view, otherwise shared */
+    int move = v->buf == NULL || lval_cells_exclusive(v);
+    for (int i = 0; i < v->count; i++){
+        b->items[i] = move ? v->cell[i] : lval_copy(v->cell[i]);
+    }
+    b->fill = v->count;
+
+    if (v->buf){
+        if (move) { v->buf->fill = 0; }
+        lbuf_release(v->buf);
+    }
+    v->buf = b;
+    v->cell = b->items;
+}
+
+/* give v cells it may overwrite in place */
+static void lval_own_cells(lval* v){
+    lbuf* b = v->buf;
+    if (b == NULL) { return; }
+    /* arena values must not be written into a pooled buffer */
+    if (b->refs > 1 || (larena.active && !(b->flags & LBUF_ARENA))){
+        lval_rebuf(v, v->count);
+    }
+}
+
 lval* lval_add(lval* v, lval* x){
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count - 1] = x;
+    if (v->buf == NULL){
+        if (v->cell + v->count < v->inl + LVAL_INLINE){
+            v->cell[v->count++] = x;
+            return v;
+        }
+        /* slide back over cells popped off the front */
+        if (v->count < LVAL_INLINE){
+            memmove(v->inl, v->cell, sizeof(lval*) * v->count);
+            v->cell = v->inl;
+            v->cell[v->count++] = x;
+            return v;
+        }
+        lval_rebuf(v, v->count * 2);
+    } else {
+        /* appending past fill is invisible to other views, so a shared
+           buffer can still grow in place when v ends at its fill */
+        lbuf* b = v->buf;
+        int fits = v->cell + v->count == b->items + b->fill && b->fill < b->cap;
+        if (!fits || (larena.active && !(b->flags & LBUF_ARENA))){
+            /* doubling keeps appends amortized O(1) */
+            lval_rebuf(v, v->count * 2);
+        }
+    }
+
+    v->cell[v->count++] = x;
+    v->buf->fill++;
     return v;
 }
 
+/* Constant folding. An S-expression applying a pure builtin to literals
+   is replaced by its value as soon as it is read, wherever it sits, so
+   code that is evaluated over and over does not redo it. The operator
+   must still name its builtin: not hidden by def, and never named by a
+   binding form in code read so far, which could rebind it before the
+   fold would have run. Builtins redefined later do not change forms
+   that were already folded */
+int lfold_enabled = 1;
+
+static int lval_is_pure_op(lval* v){
+    if (lval_type(v) != LVAL_SYM) { return 0; }
+    lsym* s = v->sym;
+    if (s->builtin == NULL || s->shadowed || s->rebound) { return 0; }
+
+    lbuiltin f = s->builtin->fun;
+    return f == builtin_add || f == builtin_sub || f == builtin_mul ||
+        f == builtin_div || f == builtin_min || f == builtin_max ||
+        f == builtin_list || f == builtin_first || f == builtin_last ||
+        f == builtin_join;
+}
+
+/* mark the names v binds with let, lambdas, fun and def before anything
+   in it is folded, since those bindings only happen once it runs */
+static void lval_note_bindings(lval* v){
+    int t = lval_type(v);
+    if (t != LVAL_SEXPRE && t != LVAL_QEXPRE) { return; }
+
+    lval* op = v->count >= 2 ? v->cell[0] : NULL;
+    if (op && lval_type(op) == LVAL_SYM && op->sym->builtin &&
+        lval_type(v->cell[1]) == LVAL_QEXPRE){
+        lbuiltin f = op->sym->builtin->fun;
+        if (f == builtin_let || f == builtin_lambda || f == builtin_fun ||
+            f == builtin_def){
+            lval* names = v->cell[1];
+            for (int i = 0; i < names->count; i++){
+                if (lval_type(names->cell[i]) == LVAL_SYM){
+                    names->cell[i]->sym->rebound = 1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < v->count; i++) { lval_note_bindings(v->cell[i]); }
+}
+
+static lval* lval_fold_form(lval* v){
+    int t = lval_type(v);
+    if ((t != LVAL_SEXPRE && t != LVAL_QEXPRE) || v->count == 0) { return v; }
+
+    /* innermost first, so folded children can fold their parent */
+    v = lval_own(v);
+    lval_own_cells(v);
+    for (int i = 0; i < v->count; i++){
+        v->cell[i] = lval_fold_form(v->cell[i]);
+    }
+
+    /* a Q-expression is data, only its S-expressions are code */
+    if (t == LVAL_QEXPRE || v->count < 2 || !lval_is_pure_op(v->cell[0])){
+        return v;
+    }
+    for (int i = 1; i < v->count; i++){
+        int at = lval_type(v->cell[i]);
+        if (at != LVAL_NUM && at != LVAL_QEXPRE) { return v; }
+    }
+
+    lval* a = lval_sexpre();
+    for (int i = 1; i < v->count; i++){
+        a = lval_add(a, lval_copy(v->cell[i]));
+    }
+    /* errors are left for evaluation to report */
+    lval* x = v->cell[0]->sym->builtin->fun(NULL, a);
+    if (lval_type(x) == LVAL_ERR){
+        lval_del(x);
+        return v;
+    }
+    lval_del(v);
+    return x;
+}
+
+lval* lval_fold(lval* v){
+    lval_note_bindings(v);
+    return lval_fold_form(v);
+}
+
 lval* lval_read(mpc_ast_t* t){
 
     if (strstr(t->tag, "number")) {return lval_read_num(t);}
@@ -196,27 +1049,62 @@ lval* lval_read(mpc_ast_t* t){
     return x;
 }
 
-/* call to free for "lval*"" */
-void lval_del(lval* v){
-    
-    switch(v->type){
-        case LVAL_NUM:
-        case LVAL_FUN: break;
+/* release everything queued on the deletion stack above base */
+static void ldel_drain(int base){
+    while (ldel.sp > base){
+        lval* v = ldel.stack[--ldel.sp];
+        /* only the last owner frees */
+        if (--v->refs > 0) { continue; }
+
+        switch(v->type){
+            case LVAL_NUM: break;
+            case LVAL_FUN:
+                if (v->fun == NULL){
+                    ldel_push(v->formals);
+                    ldel_push(v->body);
+                }
+                break;
 
-        /* Free strings */
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+            /* Free strings */
+            case LVAL_ERR: free(v->err); break;
+            case LVAL_CODE: lcode_drop(v->code); break;
+            case LVAL_SYM: break;
 
-        /* run for all in expression */
-        case LVAL_QEXPRE:
-        case LVAL_SEXPRE:
-            for (int i = 0; i < v->count; i++){
-                lval_del(v->cell[i]);
-            }
-            break;
+            /* the tail goes first, so walking a long list keeps the
+               stack short */
+            case LVAL_PAIR:
+                ldel_push(v->cdr);
+                ldel_push(v->car);
+                break;
+            case LVAL_THUNK:
+                if (v->targs) { ldel_push(v->targs); }
+                if (v->tval) { ldel_push(v->tval); }
+                break;
+
+            /* run for all in expression */
+            case LVAL_QEXPRE:
+            case LVAL_SEXPRE:
+                if (v->buf){
+                    lbuf_drop(v->buf);
+                } else {
+                    for (int i = 0; i < v->count; i++){
+                        ldel_push(v->cell[i]);
+                    }
+                }
+                break;
+        }
+        /* Return lval struct to the pool */
+        lval_free(v);
     }
-    /* Free mempory for lval struct */
-    free(v);
+}
+
+/* call to free for "lval*"" */
+void lval_del(lval* v){
+    /* immediates own no memory */
+    if (lval_is_fixnum(v)) { return; }
+    int base = ldel.sp;
+    ldel_push(v);
+    ldel_drain(base);
 }
 
 void lval_expr_print(lval* v, char open, char close){
@@ -232,16 +1120,108 @@ void lval_expr_print(lval* v, char open, char close){
     putchar(close);
 }
 
+/* Forced thunks being printed. A value can contain itself through a
+   thunk, which prints as "..." where it comes round again */
+static struct {
+    lval** stack;
+    int sp;
+    int cap;
+} lprint_seen;
+
+static int lprint_enter(lval* t){
+    if (t->flags & LVAL_F_PRINTING) { return 0; }
+    t->flags |= LVAL_F_PRINTING;
+    if (lprint_seen.sp == lprint_seen.cap){
+        lprint_seen.cap = lprint_seen.cap ? lprint_seen.cap * 2 : 16;
+        lprint_seen.stack = realloc(lprint_seen.stack, sizeof(lval*) * lprint_seen.cap);
+    }
+    lprint_seen.stack[lprint_seen.sp++] = t;
+    return 1;
+}
+
+static void lprint_leave(int base){
+    while (lprint_seen.sp > base){
+        lprint_seen.stack[--lprint_seen.sp]->flags &= ~LVAL_F_PRINTING;
+    }
+}
+
+void lval_pair_print(lval* v){
+    int base = lprint_seen.sp;
+    putchar('{');
+    lval_print(v->car);
+    for (;;){
+        /* lazy tails print as far as they have been forced */
+        v = v->cdr;
+        while (lval_type(v) == LVAL_THUNK && v->tval && lprint_enter(v)){
+            v = v->tval;
+        }
+        if (lval_type(v) != LVAL_PAIR) { break; }
+        putchar(' ');
+        lval_print(v->car);
+    }
+
+    /* a proper list ends in a Q-expression, anything else is dotted */
+    if (lval_type(v) == LVAL_THUNK){
+        printf(" ...");
+    } else if (lval_type(v) == LVAL_QEXPRE){
+        for (int i = 0; i < v->count; i++){
+            putchar(' ');
+            lval_print(v->cell[i]);
+        }
+    } else {
+        printf(" . ");
+        lval_print(v);
+    }
+    putchar('}');
+    lprint_leave(base);
+}
+
+void lval_fun_print(lval* v){
+    if (v->fun){
+        printf("<function>");
+        return;
+    }
+    printf("(\\ ");
+    lval_print(v->formals);
+    putchar(' ');
+    lval_expr_print(v->body, '{', '}');
+    putchar(')');
+}
+
+/* nesting printed before the rest is elided, bounding the recursion */
+#define LPRINT_MAX_DEPTH 1000
+static int lprint_depth;
+
 /* print an lval */
 void lval_print(lval* v){
-    switch(v->type){
-        case LVAL_NUM:    printf("%li", v->num); break;
+    if (lprint_depth == LPRINT_MAX_DEPTH){
+        printf("...");
+        return;
+    }
+    lprint_depth++;
+    switch(lval_type(v)){
+        case LVAL_NUM:    printf("%li", lval_to_num(v)); break;
         case LVAL_ERR:    printf("Error: %s", v->err); break;
-        case LVAL_SYM:    printf("%s", v->sym); break;
+        case LVAL_SYM:    printf("%s", v->sym->name); break;
         case LVAL_SEXPRE: lval_expr_print(v, '(', ')'); break;
         case LVAL_QEXPRE: lval_expr_print(v, '{', '}'); break;
-        case LVAL_FUN:    printf("<function>"); break;
+        case LVAL_FUN:    lval_fun_print(v); break;
+        case LVAL_PAIR:   lval_pair_print(v); break;
+        case LVAL_CODE:   printf("<code>"); break;
+        case LVAL_THUNK: {
+            int base = lprint_seen.sp;
+            if (v->tval == NULL){
+                printf("<thunk>");
+            } else if (lprint_enter(v)){
+                lval_print(v->tval);
+                lprint_leave(base);
+            } else {
+                printf("...");
+            }
+            break;
+        }
     }
+    lprint_depth--;
 } 
 
 void lval_println(lval* v){
@@ -249,117 +1229,964 @@ void lval_println(lval* v){
     putchar('\n');
 }
 
+/* v must be owned by the caller, see lval_own */
 lval* lval_pop(lval* v, int i){
     /* find item at index i */
     lval* x = v->cell[i];
 
-    /*shift memory after index */
-    memmove(&v->cell[i], &v->cell[i+1], 
-        sizeof(lval*) * (v->count - i - 1)); 
-
+    if (i == 0){
+        /* popping the front just moves the start of the window; a
+           buffer only hands its reference over if nobody else sees it */
+        if (v->buf && v->buf->refs > 1){
+            x = lval_copy(x);
+        } else {
+            v->cell[0] = NULL;
+        }
+        v->cell++;
+    } else {
+        /* otherwise shift the rest, which needs cells of our own */
+        if (v->buf && !lval_cells_exclusive(v)){
+            lval_rebuf(v, v->count);
+            x = v->cell[i];
+        }
+        memmove(&v->cell[i], &v->cell[i+1], 
+            sizeof(lval*) * (v->count - i - 1)); 
+        if (v->buf) { v->buf->fill--; }
+    }
     v->count--;
 
-    /* reallocate used memory */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    /* release the buffer once it is empty */
+    if (v->count == 0) { lval_reset_cells(v); }
     return x;
 }
 
 lval* lval_take(lval* v, int i){
-    lval* x = lval_pop(v, i);
+    lval* x = lval_copy(v->cell[i]);
     lval_del(v);
     return x;
 }
 
 lval* lval_join(lval* x, lval* y){
-    while(y->count){
-        x = lval_add(x, lval_pop(y, 0));
+    for(int i = 0; i < y->count; i++){
+        x = lval_add(x, lval_copy(y->cell[i]));
     }
 
-    /* delete empty Y and return X */
+    /* delete Y and return X */
     lval_del(y);
     return x;
 }
 
+/* turn a list of either layout into a Q-expression */
+lval* lval_flatten(lval* v){
+    if (lval_type(v) != LVAL_PAIR) { return v; }
+
+    lval* x = lval_qexpre();
+    lval* p = v;
+    for (; lval_type(p) == LVAL_PAIR; p = p->cdr){
+        x = lval_add(x, lval_copy(p->car));
+    }
+
+    if (lval_type(p) != LVAL_QEXPRE){
+        lval_del(x);
+        lval_del(v);
+        return lval_err("Improper list");
+    }
+    x = lval_join(x, lval_copy(p));
+    lval_del(v);
+    return x;
+}
+
+/* copying shares: the value gains an owner instead of being duplicated */
 lval* lval_copy(lval* v){
+    /* immediates are their own copy */
+    if (lval_is_fixnum(v)) { return v; }
+
+    v->refs++;
+    return v;
+}
 
-    lval* x = malloc(sizeof(lval));
+/* make v safe to mutate, copying one level if anyone else holds it */
+lval* lval_own(lval* v){
+    if (lval_is_fixnum(v)) { return v; }
+    /* while the arena is up, pooled values are treated as read-only so
+       they can never end up pointing into it */
+    if (v->refs == 1 && (!larena.active || (v->flags & LVAL_F_ARENA))) {
+        return v;
+    }
+
+    lval* x = lval_alloc();
     x->type = v->type;
 
     switch(v->type){
 
-        /* Copy functions and numbers directly */
-        case LVAL_FUN: x->fun = v->fun; break;
+        /* Copy functions, numbers and symbol atoms directly */
+        case LVAL_FUN:
+            x->fun = v->fun;
+            x->formals = v->fun ? NULL : lval_copy(v->formals);
+            x->body = v->fun ? NULL : lval_copy(v->body);
+            break;
         case LVAL_NUM: x->num = v->num; break;
-
-        /* Copy strings(errors/symbols) with malloc/strcpy */
+        case LVAL_SYM:
+            x->sym = v->sym;
+            x->depth = v->depth;
+            x->slot = v->slot;
+            x->frame = v->frame;
+            x->cenv = NULL;
+            break;
+
+        /* Copy error strings with malloc/strcpy */
         case LVAL_ERR:
             x->err = malloc(strlen(v->err) + 1);
             strcpy(x->err, v->err);
             break;
 
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
+        case LVAL_PAIR:
+            x->car = lval_copy(v->car);
+            x->cdr = lval_copy(v->cdr);
             break;
 
-        /* Copy Lists by copying sub-expression */
+        /* Copy Lists by sharing the buffer, or the few inline cells */
         case LVAL_SEXPRE:
         case LVAL_QEXPRE:
             x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * x->count);
-            for(int i=0; i < x->count; i++){
-                x->cell[i] = lval_copy(v->cell[i]);
+            x->buf = v->buf;
+            if (x->buf){
+                x->buf->refs++;
+                x->cell = v->cell;
+            } else {
+                x->cell = x->inl;
+                for(int i=0; i < x->count; i++){
+                    x->cell[i] = lval_copy(v->cell[i]);
+                }
             }
             break;
     }
 
+    lval_del(v);
     return x;
 }
 
-lval* builtin_op(lenv* e, lval* l, char* op){
+static unsigned long lhash_mix(unsigned long h, unsigned long x){
+    return (h ^ x) * 1099511628211UL;
+}
 
-    for(int i = 0; i < l->count; i++){
-        if (l->cell[i]->type != LVAL_NUM){
-            lval_del(l);
-            return lval_err("Can only operate on numbers");
+/* values still to visit in lval_hash and lval_equal, which walk with an
+   explicit stack so deeply nested values cannot overflow the C stack */
+static struct {
+    lval** stack;
+    int sp;
+    int cap;
+} lwalk;
+
+static void lwalk_push(lval* v){
+    if (lwalk.sp == lwalk.cap){
+        lwalk.cap = lwalk.cap ? lwalk.cap * 2 : 256;
+        lwalk.stack = realloc(lwalk.stack, sizeof(lval*) * lwalk.cap);
+    }
+    lwalk.stack[lwalk.sp++] = v;
+}
+
+/* structural hash: values that are lval_equal hash alike. Mixes each
+   value's type and contents in preorder */
+unsigned long lval_hash(lval* v){
+    unsigned long h = 14695981039346656037UL;
+    int base = lwalk.sp;
+    lwalk_push(v);
+
+    while (lwalk.sp > base){
+        v = lwalk.stack[--lwalk.sp];
+        h = lhash_mix(h, lval_type(v));
+
+        switch(lval_type(v)){
+            case LVAL_NUM: h = lhash_mix(h, lval_to_num(v)); break;
+            case LVAL_SYM: h = lhash_mix(h, v->sym->hash); break;
+            case LVAL_ERR: h = lhash_mix(h, lsym_hash(v->err)); break;
+            case LVAL_CODE: h = lhash_mix(h, (uintptr_t)v->code); break;
+            case LVAL_THUNK: h = lhash_mix(h, (uintptr_t)v); break;
+
+            case LVAL_FUN:
+                if (v->fun){
+                    h = lhash_mix(h, (uintptr_t)v->fun);
+                } else {
+                    lwalk_push(v->body);
+                    lwalk_push(v->formals);
+                }
+                break;
+
+            /* pushed last first, so they are mixed in order */
+            case LVAL_SEXPRE:
+            case LVAL_QEXPRE:
+                h = lhash_mix(h, v->count);
+                for (int i = v->count - 1; i >= 0; i--){
+                    lwalk_push(v->cell[i]);
+                }
+                break;
+
+            case LVAL_PAIR:
+                lwalk_push(v->cdr);
+                lwalk_push(v->car);
+                break;
         }
     }
+    return h;
+}
+
+/* structural equality; lambdas compare by their code, builtins,
+   compiled code and thunks by identity. Pairs of values still to
+   compare sit on the walk stack */
+int lval_equal(lval* a, lval* b){
+    int base = lwalk.sp;
+    lwalk_push(a);
+    lwalk_push(b);
+
+    while (lwalk.sp > base){
+        b = lwalk.stack[--lwalk.sp];
+        a = lwalk.stack[--lwalk.sp];
+        if (a == b) { continue; }
+        int t = lval_type(a);
+        if (t != lval_type(b)) { goto differ; }
+
+        switch(t){
+            case LVAL_NUM:
+                if (lval_to_num(a) != lval_to_num(b)) { goto differ; }
+                break;
+            case LVAL_SYM:
+                if (a->sym != b->sym) { goto differ; }
+                break;
+            case LVAL_ERR:
+                if (strcmp(a->err, b->err) != 0) { goto differ; }
+                break;
+
+            case LVAL_FUN:
+                if (a->fun || b->fun) { goto differ; }
+                lwalk_push(a->formals);
+                lwalk_push(b->formals);
+                lwalk_push(a->body);
+                lwalk_push(b->body);
+                break;
 
+            case LVAL_SEXPRE:
+            case LVAL_QEXPRE:
+                if (a->count != b->count) { goto differ; }
+                for (int i = a->count - 1; i >= 0; i--){
+                    lwalk_push(a->cell[i]);
+                    lwalk_push(b->cell[i]);
+                }
+                break;
 
-    /* get first element */
-    lval* x = lval_pop(l, 0);
+            case LVAL_PAIR:
+                lwalk_push(a->cdr);
+                lwalk_push(b->cdr);
+                lwalk_push(a->car);
+                lwalk_push(b->car);
+                break;
 
-    /* if only on numer, just make negative if subtraction */
-    if((strcmp(op, "-") == 0) && l->count == 0){
-        x->num = -x->num;
+            /* anything else is only equal to itself */
+            default: goto differ;
+        }
     }
+    return 1;
 
-    while(l->count > 0){
+differ:
+    lwalk.sp = base;
+    return 0;
+}
 
-        lval* y = lval_pop(l, 0);
+/* copies lval_promote still has to make: an arena value and the slot
+   its pooled copy goes in */
+static struct {
+    struct lpromote_item { lval* v; lval** dst; }* stack;
+    int sp;
+    int cap;
+} lpromote;
+
+static void lpromote_push(lval* v, lval** dst){
+    if (lpromote.sp == lpromote.cap){
+        lpromote.cap = lpromote.cap ? lpromote.cap * 2 : 64;
+        lpromote.stack = realloc(lpromote.stack,
+            sizeof(struct lpromote_item) * lpromote.cap);
+    }
+    lpromote.stack[lpromote.sp].v = v;
+    lpromote.stack[lpromote.sp].dst = dst;
+    lpromote.sp++;
+}
 
-        if (strcmp(op, "+") == 0) { x->num += y->num ;}
-        if (strcmp(op, "-") == 0) { x->num -= y->num ;}
-        if (strcmp(op, "*") == 0) { x->num *= y->num ;}
-        if (strcmp(op, "/") == 0) { 
-            if (y->num == 0){
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division By Zero Error");
+/* take a reference to v that may outlive the arena, copying it into the
+   pool if it lives there; pooled parts are shared, not copied. Children
+   go through an explicit stack, so deep values cannot overflow the C
+   stack */
+lval* lval_promote(lval* v){
+    if (lval_is_fixnum(v) || !(v->flags & LVAL_F_ARENA)) { return lval_copy(v); }
+
+    int active = larena.active;
+    larena.active = 0;
+
+    lval* result;
+    int base = lpromote.sp;
+    lpromote_push(v, &result);
+    while (lpromote.sp > base){
+        lpromote.sp--;
+        v = lpromote.stack[lpromote.sp].v;
+        lval** dst = lpromote.stack[lpromote.sp].dst;
+        if (lval_is_fixnum(v) || !(v->flags & LVAL_F_ARENA)){
+            *dst = lval_copy(v);
+            continue;
+        }
+
+        lval* x = lval_alloc();
+        x->type = v->type;
+        *dst = x;
+
+        switch(v->type){
+            case LVAL_FUN:
+                x->fun = v->fun;
+                x->formals = NULL;
+                x->body = NULL;
+                if (v->fun == NULL){
+                    lpromote_push(v->formals, &x->formals);
+                    lpromote_push(v->body, &x->body);
+                }
+                break;
+            case LVAL_NUM: x->num = v->num; break;
+            case LVAL_SYM:
+                x->sym = v->sym;
+                x->depth = v->depth;
+                x->slot = v->slot;
+                x->frame = v->frame;
+                x->cenv = NULL;
+                break;
+
+            case LVAL_ERR:
+                x->err = malloc(strlen(v->err) + 1);
+                strcpy(x->err, v->err);
+                break;
+
+            /* size the cells first so the slots no longer move */
+            case LVAL_SEXPRE:
+            case LVAL_QEXPRE:
+                x->count = 0;
+                x->cell = x->inl;
+                x->buf = NULL;
+                for (int i = 0; i < v->count; i++) { lval_add(x, NULL); }
+                for (int i = 0; i < v->count; i++){
+                    lpromote_push(v->cell[i], &x->cell[i]);
+                }
                 break;
+
+            case LVAL_CODE: x->code = lcode_promote(v->code); break;
+
+            case LVAL_THUNK:
+                x->tfun = v->tfun;
+                x->tfork = v->tfork;
+                x->targs = NULL;
+                x->tval = NULL;
+                if (v->targs) { lpromote_push(v->targs, &x->targs); }
+                if (v->tval) { lpromote_push(v->tval, &x->tval); }
+                break;
+
+            case LVAL_PAIR: {
+                /* copy the arena run of a cons chain in a loop */
+                lval* tail = x;
+                lpromote_push(v->car, &tail->car);
+                while (lval_type(v->cdr) == LVAL_PAIR && (v->cdr->flags & LVAL_F_ARENA)){
+                    v = v->cdr;
+                    lval* y = lval_alloc();
+                    y->type = LVAL_PAIR;
+                    lpromote_push(v->car, &y->car);
+                    tail->cdr = y;
+                    tail = y;
+                }
+                lpromote_push(v->cdr, &tail->cdr);
+                break;
+            }
+        }
+    }
+
+    larena.active = active;
+    return result;
+}
+
+/* Resolution pass: rewrite every symbol in v that is bound in one of the
+   local frames from e down to (not including) the globals into a symbol
+   carrying its (depth, slot), so evaluating it is an array index. Shared
+   structure is only copied along paths that actually change */
+lval* lval_resolve(lenv* e, lval* v){
+    switch(lval_type(v)){
+        case LVAL_SYM: {
+            int depth = 0;
+            for (lenv* f = e; f && f->par; f = f->par, depth++){
+                int slot = lenv_find(f, v->sym);
+                if (slot >= 0){
+                    if (depth > 0) { e->outer = 1; }
+                    if (v->depth == depth && v->slot == slot &&
+                        (depth == 0 || v->frame == e->serial)) { return v; }
+                    lval* x = lval_sym_at(v->sym, depth, slot, e->serial);
+                    lval_del(v);
+                    return x;
+                }
+            }
+            /* forget a slot resolved against some other scope */
+            if (v->depth >= 0){
+                lval* x = lval_sym_at(v->sym, -1, 0, 0);
+                lval_del(v);
+                return x;
             }
-            x->num /= y->num; 
+            return v;
         }
 
-        lval_del(y);
+        case LVAL_SEXPRE:
+        case LVAL_QEXPRE: {
+            int owned = 0;
+            for (int i = 0; i < v->count; i++){
+                lval* c = v->cell[i];
+                lval* x = lval_resolve(e, lval_copy(c));
+                if (x == c) { lval_del(x); continue; }
+                if (!owned){
+                    v = lval_own(v);
+                    lval_own_cells(v);
+                    owned = 1;
+                }
+                lval_del(v->cell[i]);
+                v->cell[i] = x;
+            }
+            return v;
+        }
     }
+    /* cons pairs and the rest evaluate to themselves: nothing in them
+       is ever looked up */
+    return v;
+}
 
-    lval_del(l);
+/* the symbol that marks the rest parameter of a variadic lambda */
+static lsym* lsym_rest(void){
+    static lsym* s;
+    if (s == NULL) { s = lsym_intern("&"); }
+    return s;
+}
+
+/* names a capture leaves alone: the lambda's own parameters and those
+   of binding forms it is inside of */
+static struct {
+    lsym** syms;
+    int count;
+    int cap;
+} lcapture;
+
+static void lcapture_hide(lval* names){
+    for (int i = 0; i < names->count; i++){
+        if (lval_type(names->cell[i]) != LVAL_SYM) { continue; }
+        if (lcapture.count == lcapture.cap){
+            lcapture.cap = lcapture.cap ? lcapture.cap * 2 : 16;
+            lcapture.syms = realloc(lcapture.syms, sizeof(lsym*) * lcapture.cap);
+        }
+        lcapture.syms[lcapture.count++] = names->cell[i]->sym;
+    }
+}
+
+static int lcapture_hidden(lsym* s){
+    for (int i = lcapture.count - 1; i >= 0; i--){
+        if (lcapture.syms[i] == s) { return 1; }
+    }
+    return 0;
+}
+
+/* whether cell i of a form applying builtin f, n cells long, is code
+   the form evaluates; any other Q-expression in it is data */
+static int lcapture_is_code(lbuiltin f, int i, int n){
+    if (f == builtin_let) { return i == n - 1; }
+    if (f == builtin_lambda || f == builtin_fun) { return i == 2; }
+    if (f == builtin_eval || f == builtin_sandbox || f == builtin_delay ||
+        f == builtin_compile) { return i == 1; }
+    return 0;
+}
+
+/* Capture pass: replace every symbol in evaluated position in the code v
+   that is bound in one of the local frames from e down with its current
+   value, so a lambda built in a frame still sees those values once the
+   frame is gone. Evaluated positions are the elements of S-expressions
+   and of the Q-expressions that builtins like let and eval run as code;
+   other Q-expressions are quoted data and keep their symbols. Symbols
+   and S-expressions are not values that evaluate to themselves, so names
+   bound to them stay as they are. The names let, lambdas and fun bind
+   are hidden in their body. Substituted values are not walked */
+static lval* lval_capture(lenv* e, lval* v){
+    switch(lval_type(v)){
+        case LVAL_SYM: {
+            if (lcapture_hidden(v->sym)) { return v; }
+            for (lenv* f = e; f->par; f = f->par){
+                int slot = lenv_find(f, v->sym);
+                if (slot < 0) { continue; }
+                lval* x = f->vals[slot];
+                int t = lval_type(x);
+                if (t == LVAL_SYM || t == LVAL_SEXPRE) { return v; }
+                lval_del(v);
+                return lval_copy(x);
+            }
+            return v;
+        }
+
+        case LVAL_SEXPRE:
+        case LVAL_QEXPRE: {
+            lval* op = v->count > 0 ? v->cell[0] : NULL;
+            lbuiltin f = NULL;
+            if (op && lval_type(op) == LVAL_SYM && op->sym->builtin){
+                f = op->sym->builtin->fun;
+            }
+            int binds = v->count >= 3 && lval_type(v->cell[1]) == LVAL_QEXPRE &&
+                (f == builtin_let || f == builtin_lambda || f == builtin_fun);
+
+            int mark = lcapture.count;
+            int owned = 0;
+            for (int i = 0; i < v->count; i++){
+                lval* c = v->cell[i];
+                if (lval_type(c) == LVAL_QEXPRE &&
+                    !lcapture_is_code(f, i, v->count)) { continue; }
+                if (binds && i == v->count - 1) { lcapture_hide(v->cell[1]); }
+
+                lval* x = lval_capture(e, lval_copy(c));
+                if (x == c) { lval_del(x); continue; }
+                if (!owned){
+                    v = lval_own(v);
+                    lval_own_cells(v);
+                    owned = 1;
+                }
+                lval_del(v->cell[i]);
+                v->cell[i] = x;
+            }
+            lcapture.count = mark;
+            return v;
+        }
+    }
+    return v;
+}
+
+/* Construct a lambda. Its body is resolved once against a template of
+   its frame, so parameters are read straight from their call slots;
+   anything else is looked up by name when the body runs. Built inside
+   local frames it then captures the values of the free symbols they
+   bind, after resolution so the values themselves are never walked */
+lval* lval_lambda(lenv* e, lval* formals, lval* body){
+    lenv* g = e;
+    while (g->par) { g = g->par; }
+    lenv* f = lenv_push_frame(g, formals->count);
+    for (int i = 0; i < formals->count; i++){
+        lsym* s = formals->cell[i]->sym;
+        if (s == lsym_rest()) { continue; }
+        s->rebound = 1;
+        f->syms[f->count++] = s;
+    }
+    body = lval_own(lval_resolve(f, body));
+    body->type = LVAL_SEXPRE;
+    /* the template binds no values */
+    f->count = 0;
+    lenv_pop_frame(f);
+
+    if (e->par){
+        lcapture_hide(formals);
+        body = lval_capture(e, body);
+        lcapture.count = 0;
+    }
+
+    lval* v = lval_alloc();
+    v->type = LVAL_FUN;
+    v->fun = NULL;
+    v->formals = formals;
+    v->body = body;
+    return v;
+}
+
+/* Bytecode. lval_compile turns a read form into a code object once, and
+   lvm_run executes it on a value stack without walking the tree. Each
+   instruction is an opcode word followed by its operand:
+     OP_CONST k   push constant k
+     OP_LOAD k    push the value of symbol constant k
+     OP_CALL n    apply the top n values, as an evaluated S-expression
+     OP_RET       return the top value
+   and superinstructions for the commonest shapes, which check at run
+   time that the operator still is the builtin and fall back to the
+   generic call otherwise:
+     OP_ADD_SN f k n   (+ sym num), with f the '+' and k the symbol
+     OP_FIRST_S f k    (first sym) */
+enum { OP_CONST, OP_LOAD, OP_CALL, OP_RET, OP_ADD_SN, OP_FIRST_S };
+
+struct lcode {
+    int* ops;
+    int nops;
+    int opcap;
+    /* ops with opcodes replaced by handler addresses, made on first run
+       when the compiler supports computed goto */
+    void** thread;
+    lval** consts;
+    int nconsts;
+    int constcap;
+    /* deepest the value stack gets while this code runs */
+    int maxstack;
+    /* deepest nesting of S-expressions, which lval_eval would need as
+       many continuations for */
+    int maxnest;
+};
+
+static void lcode_word(lcode* c, int w){
+    if (c->nops == c->opcap){
+        c->opcap = c->opcap ? c->opcap * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->opcap);
+    }
+    c->ops[c->nops++] = w;
+}
+
+static void lcode_emit(lcode* c, int op, int arg){
+    lcode_word(c, op);
+    if (op != OP_RET) { lcode_word(c, arg); }
+}
+
+/* v is a symbol that names builtin f unless something rebinds it */
+static int lval_names_builtin(lval* v, lbuiltin f){
+    return lval_type(v) == LVAL_SYM && v->sym->builtin && v->sym->builtin->fun == f;
+}
+
+/* index of a new constant, taking ownership of v */
+static int lcode_const(lcode* c, lval* v){
+    if (c->nconsts == c->constcap){
+        c->constcap = c->constcap ? c->constcap * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(lval*) * c->constcap);
+    }
+    c->consts[c->nconsts] = v;
+    return c->nconsts++;
+}
+
+/* S-expressions whose children are being compiled, so deep forms do not
+   recurse on the C stack: the form, the value stack depth it starts at,
+   and the child being compiled */
+static struct {
+    struct lcomp_item { lval* v; int depth; int i; }* stack;
+    int sp;
+    int cap;
+} lcomp;
+
+/* emit code leaving the value of v on the stack, depth values deep */
+static void lcode_compile(lcode* c, lval* v, int depth){
+    int base = lcomp.sp;
+
+    for (;;){
+        if (depth + 1 > c->maxstack) { c->maxstack = depth + 1; }
+        int t = lval_type(v);
+
+        if (t == LVAL_SYM){
+            lcode_emit(c, OP_LOAD, lcode_const(c, lval_copy(v)));
+        } else if (t != LVAL_SEXPRE || v->count == 0){
+            /* () evaluates to itself, like any other constant */
+            lcode_emit(c, OP_CONST, lcode_const(c, lval_copy(v)));
+        } else {
+            if (depth + v->count > c->maxstack) { c->maxstack = depth + v->count; }
+            int nest = lcomp.sp - base + 1;
+            if (nest > c->maxnest) { c->maxnest = nest; }
+
+            if (v->count == 3 && lval_names_builtin(v->cell[0], builtin_add) &&
+                lval_type(v->cell[1]) == LVAL_SYM && lval_type(v->cell[2]) == LVAL_NUM){
+                lcode_word(c, OP_ADD_SN);
+                for (int i = 0; i < 3; i++){
+                    lcode_word(c, lcode_const(c, lval_copy(v->cell[i])));
+                }
+            } else if (v->count == 2 && lval_names_builtin(v->cell[0], builtin_first) &&
+                lval_type(v->cell[1]) == LVAL_SYM){
+                lcode_word(c, OP_FIRST_S);
+                for (int i = 0; i < 2; i++){
+                    lcode_word(c, lcode_const(c, lval_copy(v->cell[i])));
+                }
+            } else {
+                /* children in order, then apply them */
+                if (lcomp.sp == lcomp.cap){
+                    lcomp.cap = lcomp.cap ? lcomp.cap * 2 : 64;
+                    lcomp.stack = realloc(lcomp.stack, sizeof(struct lcomp_item) * lcomp.cap);
+                }
+                lcomp.stack[lcomp.sp].v = v;
+                lcomp.stack[lcomp.sp].depth = depth;
+                lcomp.stack[lcomp.sp].i = 0;
+                lcomp.sp++;
+                v = v->cell[0];
+                continue;
+            }
+        }
+
+        /* v is done: on to the next child, applying finished forms */
+        while (lcomp.sp > base){
+            struct lcomp_item* k = &lcomp.stack[lcomp.sp - 1];
+            if (++k->i < k->v->count) { break; }
+            lcode_emit(c, OP_CALL, k->v->count);
+            lcomp.sp--;
+        }
+        if (lcomp.sp == base) { return; }
+
+        struct lcomp_item* k = &lcomp.stack[lcomp.sp - 1];
+        v = k->v->cell[k->i];
+        depth = k->depth + k->i;
+    }
+}
+
+/* compile v, as lval_eval would evaluate it, into a code object */
+lval* lval_compile(lval* v){
+    lcode* c = calloc(1, sizeof(lcode));
+    lcode_compile(c, v, 0);
+    lcode_emit(c, OP_RET, 0);
+    lval_del(v);
+
+    lval* x = lval_alloc();
+    x->type = LVAL_CODE;
+    x->code = c;
     return x;
 }
 
+static void lcode_free(lcode* c){
+    free(c->ops);
+    free(c->thread);
+    free(c->consts);
+    free(c);
+}
+
+/* free c, queueing its constants on the deletion stack */
+static void lcode_drop(lcode* c){
+    for (int i = 0; i < c->nconsts; i++){
+        ldel_push(c->consts[i]);
+    }
+    lcode_free(c);
+}
+
+/* copy of c whose constants may outlive the arena */
+lcode* lcode_promote(lcode* c){
+    lcode* x = malloc(sizeof(lcode));
+    *x = *c;
+    x->ops = malloc(sizeof(int) * c->opcap);
+    memcpy(x->ops, c->ops, sizeof(int) * c->nops);
+    x->thread = NULL;
+    x->consts = malloc(sizeof(lval*) * c->constcap);
+    for (int i = 0; i < c->nconsts; i++){
+        x->consts[i] = lval_promote(c->consts[i]);
+    }
+    return x;
+}
+
+/* Mark-sweep collector over the header pool. Reference counts free most
+   values as soon as they die; the collector reclaims whatever they miss
+   and rebuilds the counts from the actual references. It only runs at
+   safe points where the environment and registered roots hold every
+   live value. */
+long lgc_min_heap = 4096;     /* never collect below this many headers */
+int lgc_growth = 2;           /* next threshold is live * growth */
+
+static struct {
+    long threshold;
+    long collections;
+    long freed;
+    lval*** roots;
+    int nroots;
+    lval** stack;
+    int sp;
+    int cap;
+    /* buffers reached by the mark phase, and found dead by the sweep */
+    lbuf** bufs;
+    int nbufs;
+    int bufcap;
+} lgc;
+
+static void lgc_push_buf(lbuf* b){
+    if (lgc.nbufs == lgc.bufcap){
+        lgc.bufcap = lgc.bufcap ? lgc.bufcap * 2 : 64;
+        lgc.bufs = realloc(lgc.bufs, sizeof(lbuf*) * lgc.bufcap);
+    }
+    lgc.bufs[lgc.nbufs++] = b;
+}
+
+/* register a slot holding a value that must survive collections */
+void lgc_add_root(lval** slot){
+    lgc.roots = realloc(lgc.roots, sizeof(lval**) * (lgc.nroots + 1));
+    lgc.roots[lgc.nroots++] = slot;
+}
+
+/* count one reference to v, queueing it for a scan on first visit */
+static void lgc_ref(lval* v){
+    if (lval_is_fixnum(v) || (v->flags & LVAL_F_STATIC)) { return; }
+    if (v->flags & LVAL_F_MARK) { v->refs++; return; }
+
+    v->flags |= LVAL_F_MARK;
+    v->refs = 1;
+    if (lgc.sp == lgc.cap){
+        lgc.cap = lgc.cap ? lgc.cap * 2 : 256;
+        lgc.stack = realloc(lgc.stack, sizeof(lval*) * lgc.cap);
+    }
+    lgc.stack[lgc.sp++] = v;
+}
+
+static void lgc_mark(lenv* e){
+    for (; e; e = e->base){
+        for (int i = 0; i < e->count; i++) { lgc_ref(e->vals[i]); }
+    }
+    for (int i = 0; i < lgc.nroots; i++){
+        if (*lgc.roots[i]) { lgc_ref(*lgc.roots[i]); }
+    }
+
+    /* explicit stack so deep lists cannot overflow the C stack */
+    while (lgc.sp > 0){
+        lval* v = lgc.stack[--lgc.sp];
+        if (v->type == LVAL_PAIR){
+            lgc_ref(v->car);
+            lgc_ref(v->cdr);
+            continue;
+        }
+        if (v->type == LVAL_FUN && v->fun == NULL){
+            lgc_ref(v->formals);
+            lgc_ref(v->body);
+            continue;
+        }
+        if (v->type == LVAL_THUNK){
+            if (v->targs) { lgc_ref(v->targs); }
+            if (v->tval) { lgc_ref(v->tval); }
+            continue;
+        }
+        if (v->type == LVAL_CODE){
+            for (int i = 0; i < v->code->nconsts; i++){
+                lgc_ref(v->code->consts[i]);
+            }
+            continue;
+        }
+        if (v->type != LVAL_SEXPRE && v->type != LVAL_QEXPRE) { continue; }
+
+        lbuf* b = v->buf;
+        if (b == NULL){
+            for (int i = 0; i < v->count; i++) { lgc_ref(v->cell[i]); }
+        } else if (b->flags & LBUF_LIVE){
+            b->refs++;
+        } else {
+            /* the buffer owns every slot, not just this window */
+            b->flags |= LBUF_LIVE;
+            b->refs = 1;
+            lgc_push_buf(b);
+            for (int i = 0; i < b->fill; i++){
+                if (b->items[i]) { lgc_ref(b->items[i]); }
+            }
+        }
+    }
+}
+
+static void lgc_sweep(void){
+    int live = lgc.nbufs;
+
+    for (int c = 0; c < lpool.nhchunks; c++){
+        lval* chunk = lpool.hchunks[c];
+        lval* end = chunk == lpool.hend - LPOOL_CHUNK / sizeof(lval)
+            ? lpool.hbump : chunk + LPOOL_CHUNK / sizeof(lval);
+
+        for (lval* v = chunk; v < end; v++){
+            if (v->type == LVAL_FREE) { continue; }
+            if (v->flags & LVAL_F_MARK) { v->flags &= ~LVAL_F_MARK; continue; }
+
+            /* unreachable: children are swept on their own, and a
+               buffer goes once, after every view of it is gone */
+            switch(v->type){
+                case LVAL_ERR: free(v->err); break;
+                case LVAL_CODE: lcode_free(v->code); break;
+                case LVAL_QEXPRE:
+                case LVAL_SEXPRE:
+                    if (v->buf && !(v->buf->flags & (LBUF_LIVE | LBUF_DEAD))){
+                        v->buf->flags |= LBUF_DEAD;
+                        lgc_push_buf(v->buf);
+                    }
+                    break;
+            }
+            lval_free(v);
+            lgc.freed++;
+        }
+    }
+
+    for (int i = live; i < lgc.nbufs; i++) { lbuf_free(lgc.bufs[i]); }
+    for (int i = 0; i < live; i++) { lgc.bufs[i]->flags &= ~LBUF_LIVE; }
+    lgc.nbufs = 0;
+}
+
+void lgc_collect(lenv* e){
+    lgc_mark(e);
+    lgc_sweep();
+    lgc.collections++;
+
+    long next = lpool.hdr.live * lgc_growth;
+    lgc.threshold = next > lgc_min_heap ? next : lgc_min_heap;
+}
+
+/* call at a safe point; collects once the heap outgrows the threshold */
+void lgc_maybe_collect(lenv* e){
+    if (lgc.threshold == 0) { lgc.threshold = lgc_min_heap; }
+    if (lpool.hdr.live >= lgc.threshold) { lgc_collect(e); }
+}
+
+/* Continuation stack of the evaluator: an entry for each S-expression
+   whose children are being evaluated, and for each environment to drop
+   once the value being computed is ready. It lives on the heap, so how
+   deep evaluation can nest is set by leval_max_depth, not the C stack.
+   A builtin that evaluates on the C stack, like force or fold, enters
+   lval_eval again; each entry leaves an LK_NEST mark so those count
+   against the same limit. They also use the C stack, which is much
+   smaller, so at most LEVAL_MAX_NEST of them can be active at once */
+enum { LK_ARGS, LK_FRAME, LK_FORK, LK_NEST };
+
+typedef struct {
+    int kind;
+    lenv* env;
+    /* LK_ARGS: the S-expression, and the child being evaluated */
+    lval* expr;
+    int i;
+} lcont;
+
+long leval_max_depth = 100000;
+#define LEVAL_MAX_NEST 4096
+
+static struct {
+    lcont* stack;
+    int sp;
+    int cap;
+    /* LK_NEST marks on the stack */
+    int nest;
+} lk;
+
+/* 0 if the stack is already leval_max_depth deep */
+static int lk_push(int kind, lenv* env, lval* expr){
+    if (lk.sp >= leval_max_depth) { return 0; }
+    if (lk.sp == lk.cap){
+        lk.cap = lk.cap ? lk.cap * 2 : 256;
+        lk.stack = realloc(lk.stack, sizeof(lcont) * lk.cap);
+    }
+    lcont* k = &lk.stack[lk.sp++];
+    k->kind = kind;
+    k->env = env;
+    k->expr = expr;
+    k->i = 0;
+    return 1;
+}
+
+/* Builtins that evaluate code return lval_tail instead of calling
+   lval_eval, and the evaluator picks the request up from ltail. The
+   environment release, if any, is dropped as kind says once x has its
+   value */
+static lval ltail_mark = { .type = LVAL_ERR, .refs = LVAL_STATIC_REFS,
+                           .flags = LVAL_F_STATIC };
+
+static struct {
+    lenv* env;
+    lval* expr;
+    int kind;
+    lenv* release;
+} ltail;
+
+lval* lval_tail(lenv* e, lval* x, int kind, lenv* release){
+    ltail.env = e;
+    ltail.expr = x;
+    ltail.kind = kind;
+    ltail.release = release;
+    return &ltail_mark;
+}
+
 lval* builtin_def(lenv* e, lval* a){
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPRE,
+    LASSERT(a, a->count > 0,
+    "Too few args passed to 'def'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPRE,
     "Cannot pass 'def' a Q-Expression");
 
     /* first arg should be list of symbols */
@@ -367,7 +2194,7 @@ lval* builtin_def(lenv* e, lval* a){
 
     /**/
     for(int i=0; i < symbols->count; i++){
-        LASSERT(a, symbols->cell[i]->type == LVAL_SYM,
+        LASSERT(a, lval_type(symbols->cell[i]) == LVAL_SYM,
         "Only symbols may be passed to 'def'");
     }
 
@@ -375,63 +2202,513 @@ lval* builtin_def(lenv* e, lval* a){
     "Incorrect number of valus passed to 'def'")
 
     for(int i = 0; i < symbols->count; i++){
-        lenv_put(e, symbols->cell[i], a->cell[i+1]);
+        lenv_def(e, symbols->cell[i], a->cell[i+1]);
+    }
+
+    lval_del(a);
+    return lval_sexpre();
+}
+
+lval* builtin_let(lenv* e, lval* a){
+    LASSERT(a, a->count >= 2,
+    "Too few args passed to 'let'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPRE,
+    "Incorrect type passed to 'let'");
+
+    /* first arg should be list of symbols, last the body */
+    lval* symbols = a->cell[0];
+
+    for(int i=0; i < symbols->count; i++){
+        LASSERT(a, lval_type(symbols->cell[i]) == LVAL_SYM,
+        "Only symbols may be passed to 'let'");
+    }
+
+    LASSERT(a, symbols->count == a->count-2,
+    "Incorrect number of values passed to 'let'");
+    LASSERT(a, lval_is_list(a->cell[a->count-1]),
+    "Incorrect type passed to 'let'");
+
+    /* bind into a frame on top of e */
+    lenv* f = lenv_push_frame(e, symbols->count);
+    for(int i = 0; i < symbols->count; i++){
+        lenv_put(f, symbols->cell[i], a->cell[i+1]);
     }
 
+    lval* body = lval_flatten(lval_pop(a, a->count-1));
     lval_del(a);
+
+    if (lval_type(body) == LVAL_ERR){
+        lenv_pop_frame(f);
+        return body;
+    }
+
+    /* resolve locals once, then run the body in the frame */
+    body = lval_own(lval_resolve(f, body));
+    body->type = LVAL_SEXPRE;
+    return lval_tail(f, body, LK_FRAME, f);
+}
+
+lval* builtin_sandbox(lenv* e, lval* a){
+    LASSERT(a, a->count == 1,
+    "Too many args passed to 'sandbox'");
+    LASSERT(a, lval_is_list(a->cell[0]),
+    "Incorrect type passed to 'sandbox'");
+
+    lval* x = lval_flatten(lval_take(a, 0));
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    x = lval_own(x);
+    x->type = LVAL_SEXPRE;
+
+    /* evaluate in a fork of the globals, dropping its defs afterwards */
+    while (e->par) { e = e->par; }
+    lenv* f = lenv_fork(e);
+    return lval_tail(f, x, LK_FORK, f);
+}
+
+/* error for a bad parameter list, or NULL */
+static char* lval_formals_error(lval* formals){
+    for (int i = 0; i < formals->count; i++){
+        if (lval_type(formals->cell[i]) != LVAL_SYM){
+            return "Only symbols may be used as parameters";
+        }
+        /* '&' must be followed by exactly one symbol */
+        if (formals->cell[i]->sym == lsym_rest() && i != formals->count - 2){
+            return "'&' must be followed by a single parameter";
+        }
+    }
+    return NULL;
+}
+
+lval* builtin_lambda(lenv* e, lval* a){
+    LASSERT(a, a->count == 2,
+    "Incorrect number of args passed to '\\'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPRE,
+    "Incorrect type passed to '\\'");
+    LASSERT(a, lval_is_list(a->cell[1]),
+    "Incorrect type passed to '\\'");
+
+    char* err = lval_formals_error(a->cell[0]);
+    LASSERT(a, err == NULL, err);
+
+    lval* body = lval_flatten(lval_pop(a, 1));
+    lval* formals = lval_pop(a, 0);
+    lval_del(a);
+    if (lval_type(body) == LVAL_ERR){
+        lval_del(formals);
+        return body;
+    }
+    return lval_lambda(e, formals, body);
+}
+
+lval* builtin_fun(lenv* e, lval* a){
+    LASSERT(a, a->count == 2,
+    "Incorrect number of args passed to 'fun'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPRE,
+    "Incorrect type passed to 'fun'");
+    LASSERT(a, a->cell[0]->count > 0,
+    "Empty q-expression passed to 'fun'");
+    LASSERT(a, lval_is_list(a->cell[1]),
+    "Incorrect type passed to 'fun'");
+
+    /* the name comes first, the parameters after it */
+    char* err = lval_formals_error(a->cell[0]);
+    LASSERT(a, err == NULL, err);
+    LASSERT(a, a->cell[0]->cell[0]->sym != lsym_rest(),
+    "'&' must be followed by a single parameter");
+
+    lval* body = lval_flatten(lval_pop(a, 1));
+    lval* formals = lval_own(lval_pop(a, 0));
+    lval_del(a);
+    if (lval_type(body) == LVAL_ERR){
+        lval_del(formals);
+        return body;
+    }
+
+    lval* name = lval_pop(formals, 0);
+    lval* f = lval_lambda(e, formals, body);
+    lenv_def(e, name, f);
+    lval_del(name);
+    lval_del(f);
     return lval_sexpre();
 }
 
+/* Bulk reductions. Long argument lists are gathered into a contiguous
+   buffer of longs and reduced in vector registers, with the widest
+   instruction set the CPU has, chosen once at run time. Sums only take
+   the vector path when no partial sum can overflow in any order, so the
+   scalar path still reports overflow exactly where it did */
+#define LBULK_MIN 32        /* shorter lists are not worth gathering */
+
+static struct {
+    long* nums;
+    int cap;
+} lbulk;
+
+static long lsum_scalar(const long* x, int n){
+    long s = 0;
+    for (int i = 0; i < n; i++) { s += x[i]; }
+    return s;
+}
+
+static long lmin_scalar(const long* x, int n){
+    long m = x[0];
+    for (int i = 1; i < n; i++) { m = x[i] < m ? x[i] : m; }
+    return m;
+}
+
+static long lmax_scalar(const long* x, int n){
+    long m = x[0];
+    for (int i = 1; i < n; i++) { m = x[i] > m ? x[i] : m; }
+    return m;
+}
+
+#ifdef LSIMD_X86
+/* SSE2 is part of x86-64, so this one needs no check */
+static long lsum_sse2(const long* x, int n){
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= n; i += 2){
+        acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)(x + i)));
+    }
+    long lane[2];
+    _mm_storeu_si128((__m128i*)lane, acc);
+    long s = lane[0] + lane[1];
+    for (; i < n; i++) { s += x[i]; }
+    return s;
+}
+
+__attribute__((target("avx2")))
+static long lsum_avx2(const long* x, int n){
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4){
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i*)(x + i)));
+    }
+    long lane[4];
+    _mm256_storeu_si256((__m256i*)lane, acc);
+    long s = lane[0] + lane[1] + lane[2] + lane[3];
+    for (; i < n; i++) { s += x[i]; }
+    return s;
+}
+
+/* 64-bit compares arrived with SSE4.2 */
+__attribute__((target("sse4.2")))
+static long lmin_sse42(const long* x, int n){
+    if (n < 2) { return lmin_scalar(x, n); }
+    __m128i m = _mm_loadu_si128((const __m128i*)x);
+    int i = 2;
+    for (; i + 2 <= n; i += 2){
+        __m128i v = _mm_loadu_si128((const __m128i*)(x + i));
+        m = _mm_blendv_epi8(m, v, _mm_cmpgt_epi64(m, v));
+    }
+    long lane[2];
+    _mm_storeu_si128((__m128i*)lane, m);
+    long r = lane[0] < lane[1] ? lane[0] : lane[1];
+    for (; i < n; i++) { r = x[i] < r ? x[i] : r; }
+    return r;
+}
+
+__attribute__((target("sse4.2")))
+static long lmax_sse42(const long* x, int n){
+    if (n < 2) { return lmax_scalar(x, n); }
+    __m128i m = _mm_loadu_si128((const __m128i*)x);
+    int i = 2;
+    for (; i + 2 <= n; i += 2){
+        __m128i v = _mm_loadu_si128((const __m128i*)(x + i));
+        m = _mm_blendv_epi8(m, v, _mm_cmpgt_epi64(v, m));
+    }
+    long lane[2];
+    _mm_storeu_si128((__m128i*)lane, m);
+    long r = lane[0] > lane[1] ? lane[0] : lane[1];
+    for (; i < n; i++) { r = x[i] > r ? x[i] : r; }
+    return r;
+}
+
+__attribute__((target("avx2")))
+static long lmin_avx2(const long* x, int n){
+    if (n < 4) { return lmin_scalar(x, n); }
+    __m256i m = _mm256_loadu_si256((const __m256i*)x);
+    int i = 4;
+    for (; i + 4 <= n; i += 4){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(m, v));
+    }
+    long lane[4];
+    _mm256_storeu_si256((__m256i*)lane, m);
+    long r = lmin_scalar(lane, 4);
+    for (; i < n; i++) { r = x[i] < r ? x[i] : r; }
+    return r;
+}
+
+__attribute__((target("avx2")))
+static long lmax_avx2(const long* x, int n){
+    if (n < 4) { return lmax_scalar(x, n); }
+    __m256i m = _mm256_loadu_si256((const __m256i*)x);
+    int i = 4;
+    for (; i + 4 <= n; i += 4){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(v, m));
+    }
+    long lane[4];
+    _mm256_storeu_si256((__m256i*)lane, m);
+    long r = lmax_scalar(lane, 4);
+    for (; i < n; i++) { r = x[i] > r ? x[i] : r; }
+    return r;
+}
+#endif
+
+static struct {
+    long (*sum)(const long*, int);
+    long (*min)(const long*, int);
+    long (*max)(const long*, int);
+} lkern;
+
+static void lkern_init(void){
+    lkern.sum = lsum_scalar;
+    lkern.min = lmin_scalar;
+    lkern.max = lmax_scalar;
+#ifdef LSIMD_X86
+    __builtin_cpu_init();
+    lkern.sum = lsum_sse2;
+    if (__builtin_cpu_supports("sse4.2")){
+        lkern.min = lmin_sse42;
+        lkern.max = lmax_sse42;
+    }
+    if (__builtin_cpu_supports("avx2")){
+        lkern.sum = lsum_avx2;
+        lkern.min = lmin_avx2;
+        lkern.max = lmax_avx2;
+    }
+#endif
+}
+
+/* copy a's numbers into lbulk.nums, returning the largest magnitude;
+   a must hold numbers only */
+static unsigned long lbulk_gather(lval* a){
+    if (lkern.sum == NULL) { lkern_init(); }
+    if (a->count > lbulk.cap){
+        lbulk.cap = a->count * 2;
+        lbulk.nums = realloc(lbulk.nums, sizeof(long) * lbulk.cap);
+    }
+
+    unsigned long big = 0;
+    for (int i = 0; i < a->count; i++){
+        long x = lval_to_num(a->cell[i]);
+        unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+        if (m > big) { big = m; }
+        lbulk.nums[i] = x;
+    }
+    return big;
+}
+
+/* Arithmetic. Each operator has its own reduction loop over plain longs,
+   with overflow checked by the compiler builtins, and a fast path for the
+   common two-number case that skips the generic list checks */
+
+/* NULL if a holds at least one arg and only numbers, otherwise the
+   error to return, with a released */
+static lval* lval_nums_error(lval* a){
+    LASSERT(a, a->count > 0,
+        "Too few args passed to operator");
+
+    for(int i = 0; i < a->count; i++){
+        LASSERT(a, lval_type(a->cell[i]) == LVAL_NUM,
+            "Can only operate on numbers");
+    }
+    return NULL;
+}
+
+/* both args of a two-arg call are numbers */
+static int lval_two_nums(lval* a){
+    return a->count == 2 && lval_type(a->cell[0]) == LVAL_NUM &&
+        lval_type(a->cell[1]) == LVAL_NUM;
+}
+
+/* release a and box the result, or report the overflow */
+static lval* lval_num_result(lval* a, long x, int overflow){
+    lval_del(a);
+    return overflow ? lval_err("Integer overflow") : lval_num(x);
+}
+
 lval* builtin_add(lenv* e, lval* a){
-    return builtin_op(e, a, "+");
+    long x;
+    if (lval_two_nums(a)){
+        int o = __builtin_add_overflow(lval_to_num(a->cell[0]),
+            lval_to_num(a->cell[1]), &x);
+        return lval_num_result(a, x, o);
+    }
+
+    lval* err = lval_nums_error(a);
+    if (err) { return err; }
+
+    /* no partial sum can overflow, so any order is exact */
+    if (a->count >= LBULK_MIN &&
+        lbulk_gather(a) <= (unsigned long)LONG_MAX / a->count){
+        return lval_num_result(a, lkern.sum(lbulk.nums, a->count), 0);
+    }
+
+    x = lval_to_num(a->cell[0]);
+    for (int i = 1; i < a->count; i++){
+        if (__builtin_add_overflow(x, lval_to_num(a->cell[i]), &x)){
+            return lval_num_result(a, x, 1);
+        }
+    }
+    return lval_num_result(a, x, 0);
 }
 
 lval* builtin_sub(lenv* e, lval* a){
-    return builtin_op(e, a, "-");
+    long x;
+    if (lval_two_nums(a)){
+        int o = __builtin_sub_overflow(lval_to_num(a->cell[0]),
+            lval_to_num(a->cell[1]), &x);
+        return lval_num_result(a, x, o);
+    }
+
+    lval* err = lval_nums_error(a);
+    if (err) { return err; }
+
+    /* a single number is negated */
+    x = lval_to_num(a->cell[0]);
+    if (a->count == 1){
+        int o = __builtin_sub_overflow(0, x, &x);
+        return lval_num_result(a, x, o);
+    }
+    for (int i = 1; i < a->count; i++){
+        if (__builtin_sub_overflow(x, lval_to_num(a->cell[i]), &x)){
+            return lval_num_result(a, x, 1);
+        }
+    }
+    return lval_num_result(a, x, 0);
 }
 
 lval* builtin_mul(lenv* e, lval* a){
-    return builtin_op(e, a, "*");
+    long x;
+    if (lval_two_nums(a)){
+        int o = __builtin_mul_overflow(lval_to_num(a->cell[0]),
+            lval_to_num(a->cell[1]), &x);
+        return lval_num_result(a, x, o);
+    }
+
+    lval* err = lval_nums_error(a);
+    if (err) { return err; }
+
+    x = lval_to_num(a->cell[0]);
+    for (int i = 1; i < a->count; i++){
+        if (__builtin_mul_overflow(x, lval_to_num(a->cell[i]), &x)){
+            return lval_num_result(a, x, 1);
+        }
+    }
+    return lval_num_result(a, x, 0);
 }
 
 lval* builtin_div(lenv* e, lval* a){
-    return builtin_op(e, a, "/");
+    long x;
+    if (lval_two_nums(a)){
+        x = lval_to_num(a->cell[0]);
+        long y = lval_to_num(a->cell[1]);
+        if (y == 0){
+            lval_del(a);
+            return lval_err("Division By Zero Error");
+        }
+        /* the one quotient that does not fit */
+        if (x == LONG_MIN && y == -1) { return lval_num_result(a, x, 1); }
+        return lval_num_result(a, x / y, 0);
+    }
+
+    lval* err = lval_nums_error(a);
+    if (err) { return err; }
+
+    x = lval_to_num(a->cell[0]);
+    for (int i = 1; i < a->count; i++){
+        long y = lval_to_num(a->cell[i]);
+        if (y == 0){
+            lval_del(a);
+            return lval_err("Division By Zero Error");
+        }
+        /* the one quotient that does not fit */
+        if (x == LONG_MIN && y == -1){
+            return lval_num_result(a, x, 1);
+        }
+        x /= y;
+    }
+    return lval_num_result(a, x, 0);
+}
+
+lval* builtin_min(lenv* e, lval* a){
+    lval* err = lval_nums_error(a);
+    if (err) { return err; }
+
+    if (a->count >= LBULK_MIN){
+        lbulk_gather(a);
+        return lval_num_result(a, lkern.min(lbulk.nums, a->count), 0);
+    }
+
+    long x = lval_to_num(a->cell[0]);
+    for (int i = 1; i < a->count; i++){
+        long y = lval_to_num(a->cell[i]);
+        if (y < x) { x = y; }
+    }
+    return lval_num_result(a, x, 0);
+}
+
+lval* builtin_max(lenv* e, lval* a){
+    lval* err = lval_nums_error(a);
+    if (err) { return err; }
+
+    if (a->count >= LBULK_MIN){
+        lbulk_gather(a);
+        return lval_num_result(a, lkern.max(lbulk.nums, a->count), 0);
+    }
+
+    long x = lval_to_num(a->cell[0]);
+    for (int i = 1; i < a->count; i++){
+        long y = lval_to_num(a->cell[i]);
+        if (y > x) { x = y; }
+    }
+    return lval_num_result(a, x, 0);
 }
 
 lval* builtin_first(lenv* e, lval* l){
     /* check to make sure not too many args */
     LASSERT(l, l->count == 1,
         "Too many args passed to 'first'");
-    /* check for qexpre */
-    LASSERT(l, l->cell[0]->type == LVAL_QEXPRE,
+    /* check for list */
+    LASSERT(l, lval_is_list(l->cell[0]),
         "Incorrect type passed to 'first'");
     /* check if empty */
-    LASSERT(l, l->cell[0]->count != 0,
+    LASSERT(l, !lval_is_empty(l->cell[0]),
         "Empty q-expression passed to 'first'");
 
     /* take first arg */
     lval* v = lval_take(l, 0);
-    /* delete everything else */
-    while(v->count > 1){ 
-        lval_del(lval_pop(v, 1));
-    }
+    /* keep only its first element, leaving the rest shared */
+    lval* head = lval_type(v) == LVAL_PAIR ? v->car : v->cell[0];
+    lval* x = lval_add(lval_qexpre(), lval_copy(head));
+    lval_del(v);
 
-    return v;
+    return x;
 }
 
 lval* builtin_last(lenv* e, lval* l){
      /* check to make sure not too many args */
     LASSERT(l, l->count == 1,
         "Too many args passed to 'last'");
-    /* check for qexpre */
-    LASSERT(l, l->cell[0]->type == LVAL_QEXPRE,
+    /* check for list */
+    LASSERT(l, lval_is_list(l->cell[0]),
         "Incorrect type passed to 'last'");
     /* check if empty */
-    LASSERT(l, l->cell[0]->count != 0 ,
+    LASSERT(l, !lval_is_empty(l->cell[0]),
         "Empty q-expression passed to 'last'");
 
+    /* the rest of a pair is shared as is, and realised if it is lazy */
+    if (lval_type(l->cell[0]) == LVAL_PAIR){
+        lval* rest = lval_copy(l->cell[0]->cdr);
+        lval_del(l);
+        return lval_force(e, rest);
+    }
+
     /* take first arg */
-    lval* v = lval_take(l, 0);
+    lval* v = lval_own(lval_take(l, 0));
     /* delete first element */
     lval_del(lval_pop(v, 0));
 
@@ -447,24 +2724,52 @@ lval* builtin_eval(lenv* e, lval* l){
      /* check to make sure not too many args */
     LASSERT(l, l->count == 1,
         "Too many args passed to 'eval'");
-    /* check for qexpre */
-    LASSERT(l, l->cell[0]->type == LVAL_QEXPRE,
+    /* compiled code runs on the VM */
+    if (lval_type(l->cell[0]) == LVAL_CODE){
+        lval* c = lval_take(l, 0);
+        lval* x = lvm_run(e, c);
+        lval_del(c);
+        return x;
+    }
+    /* check for list */
+    LASSERT(l, lval_is_list(l->cell[0]),
         "Incorrect type passed to 'eval'");
 
     /* take first arg, convert to s-expression and evaluate */
-    lval* x = lval_take(l, 0);
+    lval* x = lval_flatten(lval_take(l, 0));
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    x = lval_own(x);
+    x->type = LVAL_SEXPRE;
+    return lval_tail(e, x, LK_ARGS, NULL);
+}
+
+lval* builtin_compile(lenv* e, lval* l){
+    LASSERT(l, l->count == 1,
+        "Too many args passed to 'compile'");
+    LASSERT(l, lval_is_list(l->cell[0]),
+        "Incorrect type passed to 'compile'");
+
+    /* compiled as 'eval' would evaluate it */
+    lval* x = lval_flatten(lval_take(l, 0));
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    x = lval_own(x);
     x->type = LVAL_SEXPRE;
-    return lval_eval(e, x);
+    return lval_compile(x);
 }
 
 lval* builtin_join(lenv* e, lval* l){
-    /* check that everything is a q-expression */
+    LASSERT(l, l->count > 0,
+        "Too few args passed to 'join'");
+    /* check that everything is a list, and lay pairs out flat */
     for(int i = 0; i < l->count; i++){
-        LASSERT(l, l->cell[i]->type == LVAL_QEXPRE, 
+        LASSERT(l, lval_is_list(l->cell[i]), 
             "Incorrect type passed to 'join'");
+        l->cell[i] = lval_flatten(l->cell[i]);
+        LASSERT(l, lval_type(l->cell[i]) == LVAL_QEXPRE,
+            "Improper list passed to 'join'");
     }
 
-    lval* x = lval_pop(l, 0);
+    lval* x = lval_own(lval_pop(l, 0));
 
     while(l->count){
         x = lval_join(x, lval_pop(l, 0));
@@ -474,81 +2779,817 @@ lval* builtin_join(lenv* e, lval* l){
     return x;
 }
 
-lval* lval_eval_sexpre(lenv* e, lval* v){
+lval* builtin_cons(lenv* e, lval* l){
+    LASSERT(l, l->count == 2,
+        "Incorrect number of args passed to 'cons'");
 
-    /* eval children */
-    for (int i = 0; i < v->count; i++){
-        v->cell[i] = lval_eval(e, v->cell[i]);
+    /* the tail is shared, never copied */
+    lval* x = lval_pair(lval_copy(l->cell[0]), lval_copy(l->cell[1]));
+    lval_del(l);
+    return x;
+}
+
+lval* builtin_car(lenv* e, lval* l){
+    LASSERT(l, l->count == 1,
+        "Too many args passed to 'car'");
+    LASSERT(l, lval_is_list(l->cell[0]),
+        "Incorrect type passed to 'car'");
+    LASSERT(l, !lval_is_empty(l->cell[0]),
+        "Empty q-expression passed to 'car'");
+
+    lval* v = l->cell[0];
+    lval* x = lval_copy(lval_type(v) == LVAL_PAIR ? v->car : v->cell[0]);
+    lval_del(l);
+    return x;
+}
+
+lval* builtin_cdr(lenv* e, lval* l){
+    LASSERT(l, l->count == 1,
+        "Too many args passed to 'cdr'");
+    LASSERT(l, lval_is_list(l->cell[0]),
+        "Incorrect type passed to 'cdr'");
+    LASSERT(l, !lval_is_empty(l->cell[0]),
+        "Empty q-expression passed to 'cdr'");
+
+    /* same as 'last', which already shares the rest of either layout */
+    return builtin_last(e, l);
+}
+
+/* Lazy sequences: cons pairs whose rest is a thunk, realised one pair
+   at a time by 'last', 'cdr' and the consumers below. A consumer drops
+   each pair as it moves past it, so a sequence nobody else holds runs
+   in constant memory however long it is */
+
+lval* builtin_delay(lenv* e, lval* a){
+    LASSERT(a, a->count == 1,
+        "Too many args passed to 'delay'");
+    LASSERT(a, lval_is_list(a->cell[0]),
+        "Incorrect type passed to 'delay'");
+
+    /* evaluated as 'eval' would, when first forced */
+    lval* x = lval_flatten(lval_take(a, 0));
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    x = lval_own(x);
+    x->type = LVAL_SEXPRE;
+
+    /* it is forced wherever it ends up, so it keeps the values of the
+       frames it was made in, as a lambda does */
+    if (e->par){
+        x = lval_capture(e, x);
+        lcapture.count = 0;
+    }
+    return lval_thunk(e, NULL, x);
+}
+
+lval* builtin_force(lenv* e, lval* a){
+    LASSERT(a, a->count == 1,
+        "Too many args passed to 'force'");
+    return lval_force(e, lval_take(a, 0));
+}
+
+lval* builtin_range(lenv* e, lval* a){
+    LASSERT(a, a->count == 2,
+        "Incorrect number of args passed to 'range'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_NUM &&
+        lval_type(a->cell[1]) == LVAL_NUM,
+        "Incorrect type passed to 'range'");
+
+    long lo = lval_to_num(a->cell[0]);
+    long hi = lval_to_num(a->cell[1]);
+    lval_del(a);
+    if (lo >= hi) { return lval_qexpre(); }
+
+    /* lo, then the range after it once somebody asks */
+    lval* next = lval_add(lval_add(lval_sexpre(), lval_num(lo + 1)), lval_num(hi));
+    return lval_pair(lval_num(lo), lval_thunk(e, builtin_range, next));
+}
+
+/* the step behind 'iterate': apply f to x and go on from there */
+static lval* lseq_iterate_next(lenv* e, lval* a){
+    lval* f = lval_copy(a->cell[0]);
+    lval* x = lval_call(e, f, lval_add(lval_sexpre(), lval_copy(a->cell[1])));
+    if (x == &ltail_mark) { x = lval_eval_request(); }
+    if (lval_type(x) == LVAL_ERR){
+        lval_del(f);
+        lval_del(a);
+        return x;
+    }
+
+    lval_del(a);
+    return builtin_iterate(e, lval_add(lval_add(lval_sexpre(), f), x));
+}
+
+lval* builtin_iterate(lenv* e, lval* a){
+    LASSERT(a, a->count == 2,
+        "Incorrect number of args passed to 'iterate'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_FUN,
+        "Incorrect type passed to 'iterate'");
+
+    /* x, f x, f (f x) ... without end */
+    lval* x = lval_copy(a->cell[1]);
+    return lval_pair(x, lval_thunk(e, lseq_iterate_next, a));
+}
+
+lval* builtin_take(lenv* e, lval* a){
+    LASSERT(a, a->count == 2,
+        "Incorrect number of args passed to 'take'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_NUM,
+        "Incorrect type passed to 'take'");
+
+    long n = lval_to_num(a->cell[0]);
+    lval* seq = lval_force(e, lval_take(a, 1));
+
+    /* the first n elements, or all of them if there are fewer */
+    lval* x = lval_qexpre();
+    while (n > 0 && lval_type(seq) == LVAL_PAIR){
+        x = lval_add(x, lval_copy(seq->car));
+        /* the rest is only forced if another element is wanted from it */
+        if (--n == 0) { break; }
+        lval* rest = lval_copy(seq->cdr);
+        lval_del(seq);
+        seq = lval_force(e, rest);
+    }
+    if (lval_type(seq) == LVAL_ERR){
+        lval_del(x);
+        return seq;
+    }
+    if (lval_type(seq) == LVAL_QEXPRE){
+        for (int i = 0; n > 0 && i < seq->count; i++, n--){
+            x = lval_add(x, lval_copy(seq->cell[i]));
+        }
+    } else if (n > 0){
+        lval_del(seq);
+        lval_del(x);
+        return lval_err("Incorrect type passed to 'take'");
+    }
+    lval_del(seq);
+    return x;
+}
+
+/* acc = f acc x, with a reference to acc passed on */
+static lval* lseq_step(lenv* e, lval* f, lval* acc, lval* x){
+    lval* a = lval_add(lval_add(lval_sexpre(), acc), lval_copy(x));
+    lval* r = lval_call(e, f, a);
+    if (r == &ltail_mark) { r = lval_eval_request(); }
+    return r;
+}
+
+lval* builtin_fold(lenv* e, lval* a){
+    LASSERT(a, a->count == 3,
+        "Incorrect number of args passed to 'fold'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_FUN,
+        "Incorrect type passed to 'fold'");
+
+    lval* f = lval_copy(a->cell[0]);
+    lval* acc = lval_copy(a->cell[1]);
+    /* hold the only reference to the head, so passed pairs are freed */
+    lval* seq = lval_force(e, lval_take(a, 2));
+
+    while (lval_type(seq) == LVAL_PAIR && lval_type(acc) != LVAL_ERR){
+        acc = lseq_step(e, f, acc, seq->car);
+        lval* rest = lval_copy(seq->cdr);
+        lval_del(seq);
+        seq = lval_force(e, rest);
+    }
+    if (lval_type(seq) == LVAL_QEXPRE){
+        for (int i = 0; i < seq->count && lval_type(acc) != LVAL_ERR; i++){
+            acc = lseq_step(e, f, acc, seq->cell[i]);
+        }
+    } else if (lval_type(acc) != LVAL_ERR){
+        lval_del(acc);
+        acc = lval_type(seq) == LVAL_ERR ? lval_copy(seq)
+            : lval_err("Incorrect type passed to 'fold'");
+    }
+    lval_del(seq);
+    lval_del(f);
+    return acc;
+}
+
+/* append "name value" pairs for a pool statistics record */
+lval* lval_add_stats(lval* v, char* prefix, lpool_stats* st){
+    char name[64];
+    snprintf(name, sizeof(name), "%slive", prefix);
+    v = lval_add(lval_add(v, lval_sym(name)), lval_num(st->live));
+    snprintf(name, sizeof(name), "%speak", prefix);
+    v = lval_add(lval_add(v, lval_sym(name)), lval_num(st->peak));
+    snprintf(name, sizeof(name), "%srecycled", prefix);
+    v = lval_add(lval_add(v, lval_sym(name)), lval_num(st->recycled));
+    return v;
+}
+
+/* Memoisation. (memo f args...) calls f through a cache keyed on the
+   structure of f and its args, so a repeated call with equal inputs is
+   a lookup. The cache holds lmemo_cap entries, chained in buckets by
+   lval_hash and kept on a recency list, and drops the least recently
+   used one when it is full. Entries are promoted out of the arena, and
+   their slots are collector roots.
+   A result can depend on globals, so an entry only answers for the
+   sandbox it was made in and until the next global definition: any
+   other entry is stale and left to be evicted */
+int lmemo_cap = 256;
+
+typedef struct {
+    unsigned long hash;
+    /* the evaluated (f args...) and the result */
+    lval* key;
+    lval* val;
+    /* lenv_fork_serial and lenv_epoch when it was made */
+    unsigned fork;
+    unsigned epoch;
+    /* next entry in the same bucket, and neighbours by recency */
+    int chain;
+    int prev;
+    int next;
+} lmemo_entry;
+
+static struct {
+    lmemo_entry* entries;
+    int count;
+    int* buckets;
+    int mask;
+    /* most and least recently used entries */
+    int head;
+    int tail;
+    long hits;
+    long misses;
+    long evictions;
+} lmemo;
+
+static void lmemo_init(void){
+    if (lmemo_cap < 1) { lmemo_cap = 1; }
+    lmemo.entries = calloc(lmemo_cap, sizeof(lmemo_entry));
+    for (int i = 0; i < lmemo_cap; i++){
+        lgc_add_root(&lmemo.entries[i].key);
+        lgc_add_root(&lmemo.entries[i].val);
     }
 
+    int n = 16;
+    while (n < lmemo_cap * 2) { n *= 2; }
+    lmemo.buckets = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; i++) { lmemo.buckets[i] = -1; }
+    lmemo.mask = n - 1;
+    lmemo.head = lmemo.tail = -1;
+}
+
+static void lmemo_unlink(int i){
+    lmemo_entry* m = &lmemo.entries[i];
+    if (m->prev >= 0) { lmemo.entries[m->prev].next = m->next; }
+    else { lmemo.head = m->next; }
+    if (m->next >= 0) { lmemo.entries[m->next].prev = m->prev; }
+    else { lmemo.tail = m->prev; }
+}
+
+static void lmemo_push_front(int i){
+    lmemo_entry* m = &lmemo.entries[i];
+    m->prev = -1;
+    m->next = lmemo.head;
+    if (lmemo.head >= 0) { lmemo.entries[lmemo.head].prev = i; }
+    lmemo.head = i;
+    if (lmemo.tail < 0) { lmemo.tail = i; }
+}
+
+static int lmemo_find(unsigned long h, unsigned fork, lval* key){
+    for (int i = lmemo.buckets[h & lmemo.mask]; i >= 0; i = lmemo.entries[i].chain){
+        lmemo_entry* m = &lmemo.entries[i];
+        if (m->hash == h && m->fork == fork && m->epoch == lenv_epoch &&
+            lval_equal(m->key, key)) { return i; }
+    }
+    return -1;
+}
+
+/* a free entry, evicting the least recently used one if need be */
+static int lmemo_slot(void){
+    if (lmemo.count < lmemo_cap) { return lmemo.count++; }
+
+    int i = lmemo.tail;
+    lmemo_entry* m = &lmemo.entries[i];
+    int* p = &lmemo.buckets[m->hash & lmemo.mask];
+    while (*p != i) { p = &lmemo.entries[*p].chain; }
+    *p = m->chain;
+    lmemo_unlink(i);
+    lval_del(m->key);
+    lval_del(m->val);
+    m->key = m->val = NULL;
+    lmemo.evictions++;
+    return i;
+}
+
+lval* builtin_memo(lenv* e, lval* a){
+    LASSERT(a, a->count > 0,
+        "Too few args passed to 'memo'");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_FUN,
+        "Incorrect type passed to 'memo'");
+
+    if (lmemo.entries == NULL) { lmemo_init(); }
+    unsigned long h = lval_hash(a);
+    unsigned fork = lenv_fork_serial(e);
+    int i = lmemo_find(h, fork, a);
+    if (i >= 0){
+        lmemo.hits++;
+        lmemo_unlink(i);
+        lmemo_push_front(i);
+        lval_del(a);
+        return lval_copy(lmemo.entries[i].val);
+    }
+    lmemo.misses++;
+
+    /* taken before the call, so a call that defines something itself
+       is never answered from the cache */
+    unsigned epoch = lenv_epoch;
+
+    /* the call consumes its own view of the args, a stays the key */
+    lval* args = lval_own(lval_copy(a));
+    lval* f = lval_pop(args, 0);
+    lval* x = lval_call(e, f, args);
+    if (x == &ltail_mark) { x = lval_eval_request(); }
+    lval_del(f);
+
+    /* failures are not remembered */
+    if (lval_type(x) == LVAL_ERR){
+        lval_del(a);
+        return x;
+    }
+
+    i = lmemo_slot();
+    lmemo_entry* m = &lmemo.entries[i];
+    m->hash = h;
+    m->fork = fork;
+    m->epoch = epoch;
+    m->key = lval_promote(a);
+    m->val = lval_promote(x);
+    m->chain = lmemo.buckets[h & lmemo.mask];
+    lmemo.buckets[h & lmemo.mask] = i;
+    lmemo_push_front(i);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_memo_stats(lenv* e, lval* l){
+    LASSERT(l, l->count == 1 && lval_is_empty(l->cell[0]),
+        "Function 'memo-stats' takes {}");
+    lval_del(l);
+
+    long calls = lmemo.hits + lmemo.misses;
+    lval* v = lval_qexpre();
+    v = lval_add(lval_add(v, lval_sym("hits")), lval_num(lmemo.hits));
+    v = lval_add(lval_add(v, lval_sym("misses")), lval_num(lmemo.misses));
+    /* whole percent, there are no fractions */
+    v = lval_add(lval_add(v, lval_sym("hit-percent")),
+        lval_num(calls ? lmemo.hits * 100 / calls : 0));
+    v = lval_add(lval_add(v, lval_sym("evictions")), lval_num(lmemo.evictions));
+    v = lval_add(lval_add(v, lval_sym("size")), lval_num(lmemo.count));
+    v = lval_add(lval_add(v, lval_sym("capacity")), lval_num(lmemo_cap));
+    return v;
+}
+
+/* the stats builtins take an empty Q-expression, as in (pool-stats {}),
+   since a function alone in an S-expression is returned, not called */
+lval* builtin_pool_stats(lenv* e, lval* l){
+    LASSERT(l, l->count == 1 && lval_is_empty(l->cell[0]),
+        "Function 'pool-stats' takes {}");
+
+    /* snapshot before building the result so it does not count itself */
+    lpool_stats hdr = lpool.hdr;
+    lpool_stats cells = lpool.cells;
+    lval_del(l);
+
+    lval* v = lval_qexpre();
+    v = lval_add_stats(v, "", &hdr);
+    v = lval_add_stats(v, "cells-", &cells);
+    return v;
+}
+
+lval* builtin_gc_stats(lenv* e, lval* l){
+    LASSERT(l, l->count == 1 && lval_is_empty(l->cell[0]),
+        "Function 'gc-stats' takes {}");
+    lval_del(l);
+
+    lval* v = lval_qexpre();
+    v = lval_add(lval_add(v, lval_sym("collections")), lval_num(lgc.collections));
+    v = lval_add(lval_add(v, lval_sym("freed")), lval_num(lgc.freed));
+    v = lval_add(lval_add(v, lval_sym("live")), lval_num(lpool.hdr.live));
+    v = lval_add(lval_add(v, lval_sym("threshold")),
+        lval_num(lgc.threshold ? lgc.threshold : lgc_min_heap));
+    return v;
+}
+
+/* call f with the evaluated args a; a lambda gets a frame on the
+   evaluator stack, holding its parameters in order, and its body is
+   handed back to the evaluator to run there */
+lval* lval_call(lenv* e, lval* f, lval* a){
+    if (f->fun) { return f->fun(e, a); }
+
+    lval* formals = f->formals;
+    int n = formals->count;
+    int rest = n >= 2 && formals->cell[n-2]->sym == lsym_rest();
+    int fixed = rest ? n - 2 : n;
+    if (rest ? a->count < fixed : a->count != fixed){
+        lval_del(a);
+        return lval_err("Incorrect number of args passed to function");
+    }
+
+    lenv* fr = lenv_push_frame(e, rest ? fixed + 1 : fixed);
+    for (int i = 0; i < fixed; i++){
+        fr->syms[i] = formals->cell[i]->sym;
+        fr->vals[i] = lval_pop(a, 0);
+    }
+    fr->count = fixed;
+
+    /* whatever is left over is the rest parameter */
+    if (rest){
+        a->type = LVAL_QEXPRE;
+        fr->syms[fr->count] = formals->cell[n-1]->sym;
+        fr->vals[fr->count++] = a;
+    } else {
+        lval_del(a);
+    }
+
+    return lval_tail(fr, lval_copy(f->body), LK_FRAME, fr);
+}
+
+/* apply an S-expression whose children have all been evaluated */
+lval* lval_apply(lenv* e, lval* v){
     /* error check */
     for (int i = 0; i < v->count; i++){
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+        if (lval_type(v->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
     }
 
-    /* empty */
-    if (v->count == 0){return v;}
-
     /* single expression */
     if (v->count == 1) { return lval_take(v, 0); }
 
     /* ensure first element is symbol */
     lval* f = lval_pop(v, 0);
 
-    if (f->type != LVAL_FUN){
+    if (lval_type(f) != LVAL_FUN){
         lval_del(f); 
         lval_del(v);
         return lval_err("First Element is Not a Function");
     }
 
     /* call function to get result */
-    lval* result = f->fun(e, v);
+    lval* result = lval_call(e, f, v);
     lval_del(f);
     return result;
-
 }
 
+/* Evaluate v in e without recursing on the C stack: S-expressions push
+   a continuation and descend into their children, and each value is
+   handed back down the continuation stack until something else needs
+   evaluating. Re-entrant: it returns once the stack is back where it
+   was on entry */
 lval* lval_eval(lenv* e, lval* v){
-    if (v->type == LVAL_SYM){
-        lval* x = lenv_get(e, v);
+    if (lk.nest >= LEVAL_MAX_NEST || !lk_push(LK_NEST, e, NULL)){
         lval_del(v);
-        return x;
+        return lval_err("Maximum evaluation depth exceeded");
+    }
+    lk.nest++;
+    int base = lk.sp;
+    lval* x;
+
+eval:
+    switch (lval_type(v)){
+        case LVAL_SYM:
+            x = lenv_get(e, v);
+            lval_del(v);
+            break;
+
+        case LVAL_SEXPRE:
+            /* evaluation rewrites the cells in place */
+            v = lval_own(v);
+            lval_own_cells(v);
+            if (v->count == 0) { x = v; break; }
+            if (!lk_push(LK_ARGS, e, v)){
+                lval_del(v);
+                x = lval_err("Maximum evaluation depth exceeded");
+                break;
+            }
+            v = v->cell[0];
+            goto eval;
+
+        default:
+            x = v;
+            break;
     }
-    /* evaluate s expression*/
-    if (v->type == LVAL_SEXPRE){
-        return lval_eval_sexpre(e, v);
+
+    while (lk.sp > base){
+        lcont* k = &lk.stack[lk.sp - 1];
+
+        if (k->kind == LK_FRAME || k->kind == LK_FORK){
+            lk.sp--;
+            if (k->kind == LK_FRAME) { lenv_pop_frame(k->env); }
+            else { lenv_discard(k->env); }
+            continue;
+        }
+
+        /* the child's slot takes its value; on to the next child */
+        k->expr->cell[k->i++] = x;
+        if (k->i < k->expr->count){
+            e = k->env;
+            v = k->expr->cell[k->i];
+            goto eval;
+        }
+
+        lk.sp--;
+        x = lval_apply(k->env, k->expr);
+        if (x != &ltail_mark) { continue; }
+
+        /* a builtin handed code back to evaluate as its result; with
+           nothing to release afterwards it runs in the current entry */
+        e = ltail.env;
+        v = ltail.expr;
+        if (ltail.release == NULL) { goto eval; }
+
+        /* a frame that only replaces the one whose result this is takes
+           over its slot instead of stacking on top */
+        k = lk.sp > base ? &lk.stack[lk.sp - 1] : NULL;
+        if (ltail.kind == LK_FRAME && k && k->kind == LK_FRAME &&
+            lenv_reuse_frame(k->env, ltail.release)){
+            e = k->env;
+            goto eval;
+        }
+
+        if (!lk_push(ltail.kind, ltail.release, NULL)){
+            if (ltail.kind == LK_FRAME) { lenv_pop_frame(ltail.release); }
+            else { lenv_discard(ltail.release); }
+            lval_del(v);
+            x = lval_err("Maximum evaluation depth exceeded");
+            continue;
+        }
+        goto eval;
     }
+    /* drop this entry's mark */
+    lk.sp--;
+    lk.nest--;
+    return x;
+}
+
+/* evaluate a request made through lval_tail by a builtin called from
+   outside lval_eval */
+lval* lval_eval_request(void){
+    lenv* release = ltail.release;
+    int kind = ltail.kind;
+    lval* x = lval_eval(ltail.env, ltail.expr);
+    if (release && kind == LK_FRAME) { lenv_pop_frame(release); }
+    if (release && kind == LK_FORK) { lenv_discard(release); }
+    return x;
+}
+
+/* thunks being forced whose value is not known yet: when a thunk's
+   value is another thunk, that one is forced next, and the final value
+   is handed back to all of them */
+static struct {
+    lval** stack;
+    int sp;
+    int cap;
+} lforce;
+
+/* the value of v, forcing it first if it is a thunk. A thunk keeps its
+   value, so it is only computed once, unless that value is an error or
+   was computed inside a sandbox the thunk was made outside of: it could
+   depend on definitions the sandbox drops, so it is not cached. Thunks
+   stay marked while forced, so a cycle of them ends in an error */
+lval* lval_force(lenv* e, lval* v){
+    int base = lforce.sp;
+
+    while (lval_type(v) == LVAL_THUNK){
+        if (v->tval){
+            lval* x = lval_copy(v->tval);
+            lval_del(v);
+            v = x;
+            continue;
+        }
+        if (v->flags & LVAL_F_FORCING){
+            int self = lforce.sp > base && lforce.stack[lforce.sp - 1] == v;
+            lval_del(v);
+            v = lval_err(self ? "Thunk evaluates to itself"
+                              : "Thunk forced while it was being forced");
+            break;
+        }
+
+        v->flags |= LVAL_F_FORCING;
+        if (lforce.sp == lforce.cap){
+            lforce.cap = lforce.cap ? lforce.cap * 2 : 16;
+            lforce.stack = realloc(lforce.stack, sizeof(lval*) * lforce.cap);
+        }
+        lforce.stack[lforce.sp++] = v;
 
+        lval* args = lval_copy(v->targs);
+        v = v->tfun ? v->tfun(e, args) : lval_eval(e, args);
+        if (v == &ltail_mark) { v = lval_eval_request(); }
+    }
+
+    unsigned fork = lenv_fork_serial(e);
+    while (lforce.sp > base){
+        lval* t = lforce.stack[--lforce.sp];
+        t->flags &= ~LVAL_F_FORCING;
+        if (lval_type(v) != LVAL_ERR && (fork == 0 || fork == t->tfork)){
+            /* a pooled thunk must not keep a value from the arena */
+            if (larena.active && !(t->flags & LVAL_F_ARENA)){
+                lval* p = lval_promote(v);
+                lval_del(v);
+                v = p;
+            }
+            t->tval = lval_copy(v);
+            lval_del(t->targs);
+            t->targs = NULL;
+        }
+        lval_del(t);
+    }
     return v;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func){
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k); 
-    lval_del(v);
+/* value stack of the VM, shared by nested runs */
+static struct {
+    lval** stack;
+    int sp;
+    int cap;
+} lvm;
+
+/* apply the top n values of the VM stack, as OP_CALL does */
+static lval* lvm_apply(lenv* e, int n){
+    lvm.sp -= n;
+    lval* v = lval_sexpre();
+    for (int i = 0; i < n; i++){
+        v = lval_add(v, lvm.stack[lvm.sp + i]);
+    }
+    lval* x = lval_apply(e, v);
+    if (x == &ltail_mark) { x = lval_eval_request(); }
+    return x;
+}
+
+/* Dispatch: with labels as values each instruction jumps straight to the
+   next one's handler through the threaded copy of the code, otherwise a
+   switch in a loop reads the opcodes */
+#if defined(__GNUC__)
+#define LVM_THREADED
+#endif
+
+#ifdef LVM_THREADED
+#define LVM_OP(op)  L_##op
+#define LVM_NEXT()  goto **pc++
+#define LVM_ARG()   ((int)(intptr_t)*pc++)
+#else
+#define LVM_OP(op)  case op
+#define LVM_NEXT()  continue
+#define LVM_ARG()   (*pc++)
+#endif
+
+#ifdef LVM_THREADED
+/* operand words following each opcode */
+static const int lop_args[] = { 1, 1, 1, 0, 3, 2 };
+
+/* replace every opcode of c with the address of its handler */
+static void lcode_thread(lcode* c, void* const* handlers){
+    c->thread = malloc(sizeof(void*) * c->nops);
+    for (int i = 0; i < c->nops; ){
+        int op = c->ops[i];
+        c->thread[i++] = handlers[op];
+        for (int j = 0; j < lop_args[op]; j++, i++){
+            c->thread[i] = (void*)(intptr_t)c->ops[i];
+        }
+    }
 }
+#endif
+
+/* run a code object in e; code stays owned by the caller */
+lval* lvm_run(lenv* e, lval* code){
+    lcode* c = code->code;
+
+    /* a nested evaluator, like lval_eval; the forms it runs are as deep
+       as lval_eval would have had to go for them */
+    if (lk.nest >= LEVAL_MAX_NEST || !lk_push(LK_NEST, e, NULL)){
+        return lval_err("Maximum evaluation depth exceeded");
+    }
+    if (lk.sp + c->maxnest > leval_max_depth){
+        lk.sp--;
+        return lval_err("Maximum evaluation depth exceeded");
+    }
+    lk.nest++;
+    if (lvm.sp + c->maxstack > lvm.cap){
+        lvm.cap = (lvm.sp + c->maxstack) * 2;
+        lvm.stack = realloc(lvm.stack, sizeof(lval*) * lvm.cap);
+    }
 
-void lenv_add_builtins(lenv* e){
-    /* built-in list functions */
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "first", builtin_first);
-    lenv_add_builtin(e, "last", builtin_last);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+    /* builtins may run code themselves, and so grow the stack: it is
+       always indexed afresh, never held by pointer */
+#ifdef LVM_THREADED
+    static void* const handlers[] = {
+        &&L_OP_CONST, &&L_OP_LOAD, &&L_OP_CALL, &&L_OP_RET,
+        &&L_OP_ADD_SN, &&L_OP_FIRST_S
+    };
+    if (c->thread == NULL) { lcode_thread(c, handlers); }
+    void** pc = c->thread;
+    LVM_NEXT();
+#else
+    int* pc = c->ops;
+    for (;;) switch (*pc++){
+#endif
+
+    LVM_OP(OP_CONST):
+        lvm.stack[lvm.sp++] = lval_copy(c->consts[LVM_ARG()]);
+        LVM_NEXT();
+
+    LVM_OP(OP_LOAD):
+        lvm.stack[lvm.sp++] = lenv_get(e, c->consts[LVM_ARG()]);
+        LVM_NEXT();
+
+    LVM_OP(OP_CALL): {
+        int n = LVM_ARG();
+        lval* x = lvm_apply(e, n);
+        lvm.stack[lvm.sp++] = x;
+        LVM_NEXT();
+    }
+
+    LVM_OP(OP_RET):
+        lk.sp--;
+        lk.nest--;
+        return lvm.stack[--lvm.sp];
+
+    LVM_OP(OP_ADD_SN): {
+        lval* f = lenv_get(e, c->consts[LVM_ARG()]);
+        lval* a = lenv_get(e, c->consts[LVM_ARG()]);
+        lval* n = c->consts[LVM_ARG()];
+        long sum;
+        if (lval_type(f) == LVAL_FUN && f->fun == builtin_add &&
+            lval_type(a) == LVAL_NUM &&
+            !__builtin_add_overflow(lval_to_num(a), lval_to_num(n), &sum)){
+            lvm.stack[lvm.sp++] = lval_num(sum);
+            lval_del(a);
+            lval_del(f);
+            LVM_NEXT();
+        }
+        lvm.stack[lvm.sp++] = f;
+        lvm.stack[lvm.sp++] = a;
+        lvm.stack[lvm.sp++] = lval_copy(n);
+        lval* x = lvm_apply(e, 3);
+        lvm.stack[lvm.sp++] = x;
+        LVM_NEXT();
+    }
+
+    LVM_OP(OP_FIRST_S): {
+        lval* f = lenv_get(e, c->consts[LVM_ARG()]);
+        lval* a = lenv_get(e, c->consts[LVM_ARG()]);
+        if (lval_type(f) == LVAL_FUN && f->fun == builtin_first &&
+            lval_is_list(a) && !lval_is_empty(a)){
+            lval* head = lval_type(a) == LVAL_PAIR ? a->car : a->cell[0];
+            lvm.stack[lvm.sp++] = lval_add(lval_qexpre(), lval_copy(head));
+            lval_del(a);
+            lval_del(f);
+            LVM_NEXT();
+        }
+        lvm.stack[lvm.sp++] = f;
+        lvm.stack[lvm.sp++] = a;
+        lval* x = lvm_apply(e, 2);
+        lvm.stack[lvm.sp++] = x;
+        LVM_NEXT();
+    }
 
-    /* built-in math functions */
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+#ifndef LVM_THREADED
+    }
+#endif
+}
 
-    /* Variable definition */
-    lenv_add_builtin(e, "def", builtin_def);
+/* compile and run v once, for --vm */
+lval* lvm_eval(lenv* e, lval* v){
+    lval* c = lval_compile(v);
+    lval* x = lvm_run(e, c);
+    lval_del(c);
+    return x;
 }
 
 int main(int argc, char** argv) {
+
+    /* command line options */
+    int arena = 0;
+    int sandbox = 0;
+    int vm = 0;
+    for (int i = 1; i < argc; i++){
+        /* collector tuning */
+        if (strncmp(argv[i], "--gc-min=", 9) == 0){
+            lgc_min_heap = strtol(argv[i] + 9, NULL, 10);
+        } else if (strncmp(argv[i], "--gc-growth=", 12) == 0){
+            lgc_growth = strtol(argv[i] + 12, NULL, 10);
+        /* bump-allocate each input's temporaries and drop them in bulk */
+        } else if (strcmp(argv[i], "--arena") == 0){
+            arena = 1;
+        /* run each input in a throwaway fork of the environment */
+        } else if (strcmp(argv[i], "--sandbox") == 0){
+            sandbox = 1;
+        /* keep constant subexpressions as written */
+        } else if (strcmp(argv[i], "--no-fold") == 0){
+            lfold_enabled = 0;
+        /* compile each input to bytecode and run it on the VM */
+        } else if (strcmp(argv[i], "--vm") == 0){
+            vm = 1;
+        /* how deep evaluation may nest before it fails with an error */
+        } else if (strncmp(argv[i], "--max-depth=", 12) == 0){
+            leval_max_depth = strtol(argv[i] + 12, NULL, 10);
+        /* entries kept by the memo cache */
+        } else if (strncmp(argv[i], "--memo-size=", 12) == 0){
+            lmemo_cap = strtol(argv[i] + 12, NULL, 10);
+        }
+    }
+    if (lgc_growth < 1) { lgc_growth = 1; }
     
     /* initial parsers */
     mpc_parser_t* Number      = mpc_new("number");
@@ -574,7 +3615,6 @@ int main(int argc, char** argv) {
     puts("NnamLISP Version  0.0.0.5");
     puts("Press CTRL+C to Exit \n");
     lenv* e = lenv_new();
-    lenv_add_builtins(e);
     
     while(1){
         char* input = readline("NnamLISP> ");
@@ -587,10 +3627,19 @@ int main(int argc, char** argv) {
         mpc_result_t r;
         
         if (mpc_parse("<stdin>", input, Phrase, &r)){
-            lval* x = lval_eval(e, lval_read(r.output));
+            if (arena) { larena_begin(); }
+            lenv* env = sandbox ? lenv_fork(e) : e;
+            lval* v = lval_read(r.output);
+            if (lfold_enabled) { v = lval_fold(v); }
+            lval* x = vm ? lvm_eval(env, v) : lval_eval(env, v);
             lval_println(x);
             lval_del(x);
+            if (sandbox) { lenv_discard(env); }
+            if (arena) { larena_end(); }
             mpc_ast_delete(r.output);
+
+            /* nothing but the environment is live between inputs */
+            lgc_maybe_collect(e);
         }else{
             mpc_err_print(r.error);
             mpc_err_delete(r.error);